@@ -127,6 +127,11 @@ static std::string footer(const std::string res, const std::string energy = "",
   mm << "  ds.close();" << std::endl;
   mm << "  gs.close();" << std::endl;
   mm << "  gg.close();" << std::endl;
+  mm << "  if (cost_table) {" << std::endl;
+  mm << "    ofstream ks(fr->name() + \"_costs.csv\");" << std::endl;
+  mm << "    ks << tmp.kk.str();" << std::endl;
+  mm << "    ks.close();" << std::endl;
+  mm << "  }" << std::endl;
   mm << "  cout << std::endl;" << std::endl;
   mm << "" <<  std::endl;
   mm << "  // output" << std::endl;
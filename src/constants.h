@@ -109,8 +109,10 @@ std::string merge__(std::vector<std::string> array, std::string name = "") {
     done.push_back(label);
 
     // some tweaks
-    if (label == "f1" || label == "v2" || label == "h1")
+    if (label == "f1" || label == "v2" || label == "h1" || label == "df")
       label = label + "_";
+    else if (label == "v2ext")
+      label = "df_";
     else if (label != array.front() && label.find("Gamma") != std::string::npos)
       label = label + "_()";
 
@@ -168,6 +170,103 @@ static const std::string SCAL = (DataType == "double" ? "dscal_" : "zscal_");
 static const std::string DOT = (DataType == "double" ? "ddot_" : "zdotu_");
 static const std::string MatType = (DataType == "double" ? "Matrix" : "ZMatrix");
 
+// switches for optional code generation. All false reproduces the standard BAGEL interface.
+// prefetch operand blocks of the next inner-loop iteration asynchronously (double buffering)
+static const bool prefetch_blocks = false;
+// draw scratch blocks from a thread-local pool; the first dgemm into a fresh block uses beta = 0 instead of zero-filling
+static const bool scratch_pool = false;
+// skip block pairs whose product of norms is below a threshold (set at run time through BlockNorms, default screen_thresh)
+static const bool screen_blocks = false;
+static const double screen_thresh = 1.0e-12;
+// embed delta-containing rdm blocks into Gamma with strided axpy instead of scalar loops
+static const bool vectorize_delta = false;
+// contract merged rdm*f1 Gamma terms with gemv (sort_indices only for 4RDM) instead of scalar loops
+static const bool gamma_blas = false;
+// reuse Gamma tensors across runs through an on-disk cache (directory given by BAGEL_GAMMA_CACHE at run time)
+static const bool gamma_cache = false;
+// free intermediates right after the only task that reads them (allocation is already deferred to the first producer)
+static const bool release_intermediates = false;
+// emit per-queue peak memory estimates of intermediates (checked against BAGEL_SMITH_MEMORY in GB at run time)
+static const bool memory_estimate = false;
+// record wall time, gemm flops and bytes moved by get_block/add_block per task (TaskProfile); report and Chrome trace at the end of solve()
+static const bool profile_tasks = false;
+// give every task a static cost() with flop and size polynomials, and write them to <method>_costs.csv
+static const bool cost_table = false;
+// distribute the block tuples of a task over processes by cost (SubtaskBalancer) instead of by the owner of the output block
+static const bool balance_subtasks = false;
+// contract closed-closed and virtual-virtual blocks of f1 elementwise with their diagonal (canonical orbitals) instead of with dgemm,
+// after checking at run time that f1 is diagonal there (FockDiagonal) and otherwise falling back to dgemm;
+// only the inner kernel changes: the tasks, their get_block and sort_indices are kept (no fused denominator-scaling tasks)
+static const bool diagonal_fock = false;
+// contract FP32 copies of the blocks with sgemm/cgemm (MixedPrecision) until the residual falls below mixed_thresh, then switch to dgemm
+static const bool mixed_precision = false;
+static const double mixed_thresh = 1.0e-5;
+// contract all-active blocks with kernels of compile-time size (ActiveKernel) for active blocks up to active_kernel_max orbitals, dgemm otherwise
+static const bool active_kernels = false;
+static const int active_kernel_max = 8;
+// stack the operand blocks of all inner-loop tuples of a task and contract them with a single dgemm instead of one per tuple
+static const bool batch_gemm = false;
+// run the subtasks of residual tasks on several threads that accumulate output blocks privately (BlockAccumulator), reduced once per task
+static const bool thread_accumulate = false;
+// fuse sibling contractions with the same target indices into one task that adds to the target block once
+static const bool fuse_bcs = false;
+// accumulate all the sources of an operator task into the target block in one sweep tiled by source_tile (instead of one sort_indices each)
+static const bool fuse_sources = false;
+static const int source_tile = 32;
+// order the summed indices (inner loops and contracted dimension) so that the larger operand needs no sort before dgemm
+static const bool order_loops = false;
+// factorize v2 into density-fitted three-index integrals, (pq|rs) = sum_P (P|pq)(P|rs), so that 4-index integrals are never formed
+static const bool df_integrals = false;
+// form blocks of all-virtual v2 from the DF integrals when they are used (FourExternal), and keep the 4-external terms of MRCI in the generated code
+static const bool four_external = false;
+// build the queues of all state pairs of MRCI into one and run it once per sweep (make_*q append to a queue passed in);
+// intermediates and Gammas of all pairs are then alive together, so batches are split at BAGEL_SMITH_MEMORY (best with release_intermediates),
+// or after state_batch_max pairs if it is not set
+static const bool state_batch = false;
+static const int state_batch_max = 16;
+// seed the CASPT2 residual with the source so that one dot_product_transpose gives the energy, and add s back with the rms in one sweep
+static const bool fuse_update = false;
+// build the CASPT2 residual queue once; later iterations replay its tasks in the recorded order with the intermediates zeroed (QueueReplay)
+static const bool reuse_queues = false;
+
+int nrange__() {
+  // the auxiliary index range follows closed, active and virtual
+  return df_integrals ? 4 : 3;
+}
+
+std::string owner__(const std::string& tensor, const std::string& listind, const std::string& tuple) {
+  return balance_subtasks ? "balance.take(" + tuple + ")" : tensor + "->is_local(" + listind + ")";
+}
+
+std::string gemm__() {
+  return mixed_precision ? "MixedPrecision::get().gemm" : GEMM;
+}
+
+std::string add_block__() {
+  return thread_accumulate ? "BlockAccumulator::add(out(), odata" : "out()->add_block(odata";
+}
+
+std::string profile_scope__(const int ic) {
+  std::stringstream ss;
+  if (profile_tasks)
+    ss << "      TaskProfile::Scope profile(\"Task" << ic << "\");" << std::endl;
+  return ss.str();
+}
+
+std::string profile_flops__(const std::string& indent, const std::string& m, const std::string& n, const std::string& k) {
+  std::stringstream ss;
+  if (profile_tasks)
+    ss << indent << "TaskProfile::flops() += " << (DataType == "double" ? "2.0" : "8.0") << "*" << m << "*" << n << "*" << k << ";" << std::endl;
+  return ss.str();
+}
+
+std::string profile_bytes__(const std::string& indent, const std::string& tensor, const std::string& index) {
+  std::stringstream ss;
+  if (profile_tasks)
+    ss << indent << "TaskProfile::bytes() += " << tensor << "->get_size(" << index << ")*sizeof(" << DataType << ");" << std::endl;
+  return ss.str();
+}
+
 // used in main.cc
 static const std::string _C = "c";
 static const std::string _X = "x";
@@ -39,6 +39,101 @@ string PCost::show() const {
 }
 
 
+MCost::MCost(const list<string>& labels) {
+  vector<int> exponent(indmap_.size());
+  for (auto& i : labels) ++exponent[indmap_.type(i)];
+  terms_[exponent] = 1;
+}
+
+
+bool MCost::bounded_by(const MCost& other) const {
+  for (auto& i : terms_) {
+    auto j = other.terms_.find(i.first);
+    if (j == other.terms_.end() || j->second < i.second) return false;
+  }
+  return true;
+}
+
+
+double MCost::estimate() const {
+  double out = 0.0;
+  for (auto& i : terms_) {
+    double term = i.second;
+    auto k = i.first.begin();
+    for (auto j = indmap_.begin(); j != indmap_.end(); ++j, ++k)
+      term *= pow(static_cast<double>(j->second.second), *k);
+    out += term;
+  }
+  return out;
+}
+
+
+string MCost::show() const {
+  stringstream out;
+  for (auto i = terms_.rbegin(); i != terms_.rend(); ++i) {
+    string term = i->second != 1 ? to_string(i->second) : "";
+    auto k = i->first.begin();
+    for (auto j = indmap_.begin(); j != indmap_.end(); ++j, ++k)
+      if (*k) term += j->first + (*k != 1 ? to_string(*k) : "");
+    out << (i != terms_.rbegin() ? " + " : "") << (term.empty() ? "1" : term);
+  }
+  return terms_.empty() ? "0" : out.str();
+}
+
+
+string MCost::generate() const {
+  const map<string, string> range = {{"c", "closed_"}, {"x", "active_"}, {"a", "virt_"}, {"ci", "ci_"}, {"P", "aux_"}};
+  stringstream out;
+  for (auto i = terms_.rbegin(); i != terms_.rend(); ++i) {
+    string term = i->second != 1 ? to_string(i->second) : "";
+    auto k = i->first.begin();
+    for (auto j = indmap_.begin(); j != indmap_.end(); ++j, ++k)
+      for (int l = 0; l != *k; ++l)
+        term += (term.empty() ? "" : "*") + range.at(j->first) + ".size()";
+    out << (i != terms_.rbegin() ? " + " : "") << (term.empty() ? "1" : term);
+  }
+  return out.str();
+}
+
+
+string MCost::generate_terms() const {
+  stringstream out;
+  out << "{";
+  for (auto i = terms_.rbegin(); i != terms_.rend(); ++i) {
+    out << (i != terms_.rbegin() ? ", " : "") << "{" << i->second << ".0, {{";
+    for (auto j = i->first.begin(); j != i->first.end(); ++j)
+      out << (j != i->first.begin() ? "," : "") << *j;
+    out << "}}}";
+  }
+  out << "}";
+  return out.str();
+}
+
+
+OutStream smith::generate_task_cost(const int ic, const int depth, const MCost& flops, const MCost& out, const vector<MCost>& in) {
+  OutStream o;
+  o.tt << "    static TaskCost cost();" << endl;
+
+  o.cc << "TaskCost Task" << ic << "::cost() {" << endl;
+  o.cc << "  TaskCost out;" << endl;
+  o.cc << "  out.depth = " << depth << ";" << endl;
+  o.cc << "  out.flops = " << flops.generate_terms() << ";" << endl;
+  o.cc << "  out.out = " << out.generate_terms() << ";" << endl;
+  o.cc << "  out.in = {";
+  for (auto i = in.begin(); i != in.end(); ++i)
+    o.cc << (i != in.begin() ? ", " : "") << i->generate_terms();
+  o.cc << "};" << endl;
+  o.cc << "  return out;" << endl;
+  o.cc << "}" << endl << endl << endl;
+
+  o.kk << "Task" << ic << "," << depth << "," << flops.show() << "," << out.show() << ",";
+  for (auto i = in.begin(); i != in.end(); ++i)
+    o.kk << (i != in.begin() ? " " : "") << i->show();
+  o.kk << endl;
+  return o;
+}
+
+
 void Cost::sort_pcost() {
   sort(cost_.rbegin(), cost_.rend());
 }
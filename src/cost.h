@@ -28,7 +28,9 @@
 
 #include <cmath>
 #include <cassert>
+#include <map>
 #include "indexmap.h"
+#include "output.h"
 
 namespace smith {
 
@@ -82,6 +84,56 @@ class PCost {
 
 };
 
+/// A class for polynomials in the sizes of index classes, used for numbers of elements (memory) and operations.
+class MCost {
+
+  protected:
+    /// exponents of index classes (ordered as in IndexMap) mapped to coefficients
+    std::map<std::vector<int>, long> terms_;
+    /// mapping information.
+    IndexMap indmap_;
+
+  public:
+    /// Construct the number of elements of a tensor (or loop) from the labels of its indices.
+    MCost(const std::list<std::string>& labels);
+    /// Construct zero.
+    MCost() { }
+    ~MCost() { }
+
+    /// add polynomial.
+    MCost& operator+=(const MCost& o) {
+      for (auto& i : o.terms_) terms_[i.first] += i.second;
+      return *this;
+    }
+    /// multiply by integer.
+    MCost operator*(const long a) const {
+      MCost out(*this);
+      for (auto& i : out.terms_) i.second *= a;
+      return out;
+    }
+
+    /// return true if estimated memory is less than other.
+    bool operator<(const MCost& other) const { return estimate() < other.estimate(); }
+    /// return true if all coefficients are at most those of other, i.e., never larger than other.
+    bool bounded_by(const MCost& other) const;
+    /// return true if zero.
+    bool empty() const { return terms_.empty(); }
+
+    /// Returns the number of elements with the typical sizes of index classes in IndexMap.
+    double estimate() const;
+
+    /// Show polynomial, e.g., c2a2 + 2x4.
+    std::string show() const;
+    /// Generates the polynomial in terms of orbital ranges (closed_.size() etc).
+    std::string generate() const;
+    /// Generates the polynomial as an initializer list of TaskCost::Polynomial, i.e., {{coefficient, {{exponents}}}, ...}.
+    std::string generate_terms() const;
+
+};
+
+/// Generates TaskN::cost() that returns flops, sizes of output and inputs and depth of task ic, and its row in the cost table.
+OutStream generate_task_cost(const int ic, const int depth, const MCost& flops, const MCost& out, const std::vector<MCost>& in);
+
 /// Class to compute cost.
 class Cost {
 
@@ -66,7 +66,7 @@ OutStream Energy::generate_compute_header(const int ic, const list<shared_ptr<co
   // if index is empty give dummy arg
   out.tt << "    class Task_local : public SubTask<" << (ti.empty() ? 1 : nindex) << "," << ninptensors << "> {" << endl;
   out.tt << "      protected:" << endl;
-  out.tt << "        const std::array<std::shared_ptr<const IndexRange>,3> range_;" << endl << endl;
+  out.tt << "        const std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range_;" << endl << endl;
 
   out.tt << "        const Index& b(const size_t& i) const { return this->block(i); }" << endl;
   out.tt << "        std::shared_ptr<const Tensor> in(const size_t& i) const { return this->in_tensor(i); }" << endl;
@@ -78,11 +78,11 @@ OutStream Energy::generate_compute_header(const int ic, const list<shared_ptr<co
   // if index is empty use dummy index 1 to subtask
   if (ti.empty()) {
     out.tt << "        Task_local(const std::array<std::shared_ptr<const Tensor>," << ninptensors <<  ">& in, std::shared_ptr<Tensor>& out," << endl;
-    out.tt << "                   std::array<std::shared_ptr<const IndexRange>,3>& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
+    out.tt << "                   std::array<std::shared_ptr<const IndexRange>," << nrange__() << ">& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
     out.tt << "          : SubTask<1," << ninptensors << ">(std::array<const Index, 1>(), in, out), range_(ran)" << (need_e0 ? ", e0_(e)" : "") << " { }" << endl;
   } else {
     out.tt << "        Task_local(const std::array<const Index," << nindex << ">& block, const std::array<std::shared_ptr<const Tensor>," << ninptensors <<  ">& in, std::shared_ptr<Tensor>& out," << endl;
-    out.tt << "                   std::array<std::shared_ptr<const IndexRange>,3>& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
+    out.tt << "                   std::array<std::shared_ptr<const IndexRange>," << nrange__() << ">& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
     out.tt << "          : SubTask<" << nindex << "," << ninptensors << ">(block, in, out), range_(ran)" << (need_e0 ? ", e0_(e)" : "") << " { }" << endl;
   }
   out.tt << endl;
@@ -130,21 +130,30 @@ OutStream Energy::generate_compute_footer(const int ic, const list<shared_ptr<co
   out.tt << "" << endl;
 
   out.tt << "    void compute_() override {" << endl;
+  out.tt << profile_scope__(ic);
   out.tt << "      if (!out_->allocated())" << endl;
   out.tt << "        out_->allocate();" << endl;
   out.tt << "      for (auto& i : in_)" << endl;
   out.tt << "        i->init();" << endl;
+  if (screen_blocks) {
+    out.tt << "      for (auto& i : in_)" << endl;
+    out.tt << "        BlockNorms::get().update(i);" << endl;
+  }
   out.tt << "      this->target_ = 0.0;" << endl;
   out.tt << "      for (auto& i : subtasks_) {" << endl;
   out.tt << "        i->compute();" << endl;
   out.tt << "        this->target_ += i->target();" << endl;
   out.tt << "      }" << endl;
+  if (screen_blocks)
+    out.tt << "      BlockNorms::get().erase(out_);" << endl;
+  if (release_intermediates)
+    out.tt << generate_release(tensors);
   out.tt << "    }" << endl << endl;
 
   out.tt << "  public:" << endl;
-  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
+  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
 
-  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
+  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
   out.cc << "  array<shared_ptr<const Tensor>," << ninptensors << "> in = {{";
   for (auto i = 1; i < ninptensors + 1; ++i)
     out.cc << "t[" << i << "]" << (i < ninptensors ? ", " : "");
@@ -152,6 +161,8 @@ OutStream Energy::generate_compute_footer(const int ic, const list<shared_ptr<co
 
   out.cc << "  out_ = t[0];" << endl;
   out.cc << "  in_ = in;" << endl << endl;
+  if (balance_subtasks)
+    out.cc << "  SubtaskBalancer balance;" << endl;
 
   // over original outermost indices
   if (!ti.empty()) {
@@ -182,7 +193,7 @@ OutStream Energy::generate_compute_footer(const int ic, const list<shared_ptr<co
   } else {
     listind2 = listind;
   }
-  out.cc << indent << "if (t[" << (dot ? 1 : 0) << "]->is_local("<< listind2 << "))" << endl;
+  out.cc << indent << "if (" << owner__("t[" + to_string(dot ? 1 : 0) + "]", listind2, listind) << ")" << endl;
   indent += "  ";
   // add subtasks
   if (!ti.empty()) {
@@ -193,6 +204,8 @@ OutStream Energy::generate_compute_footer(const int ic, const list<shared_ptr<co
   }
   out.cc << "}" << endl << endl << endl;
 
+  if (cost_table)
+    out << generate_cost(ic, tensors);
   out.tt << "    ~Task" << ic << "() {}" << endl;
   out.tt << "};" << endl << endl;
   return out;
@@ -205,60 +218,86 @@ OutStream Energy::generate_bc(const shared_ptr<BinaryContraction> i) const {
   if (depth() != 0) {
     const string bindent = "  ";
     string dindent = bindent;
+    list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
+    list<shared_ptr<const Index>> di = i->loop_indices();
+
+    // with the scratch pool, the first dgemm overwrites odata_sorted and the final sort overwrites odata
+    const bool overwrite = scratch_pool && depth() != 1
+                        && (i->tensor()->generate_dim(di).first != "" || i->next_target()->generate_dim(di).first != "");
     // skip if energy tree depth is 1
-    if (depth() != 1) {
+    if (overwrite) {
+      out.dd << target_->generate_pooled_block(dindent, "odata", "out()", target_->generate_block_index(), false);
+      out.dd << target_->generate_pooled_block(dindent, "odata_sorted", "out()", target_->generate_block_index(), false);
+    } else if (depth() != 1) {
       out.dd << target_->generate_get_block(dindent, "o", "out()", true);
       out.dd << target_->generate_scratch_area(dindent, "o", "out()", true); // true means zero-out
     }
 
-    list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
-
     // inner loop will show up here
     // but only if outer loop is not empty
-    list<shared_ptr<const Index>> di = i->loop_indices();
     vector<string> close2;
-    if (ti.size() != 0) {
+    if (overwrite && ti.size() != 0 && !di.empty())
+      out.dd << dindent << DataType << " beta = 0.0;" << endl;
+    if (ti.size() != 0 && !di.empty() && prefetch_blocks) {
       out.dd << endl;
-      for (auto iter = di.rbegin(); iter != di.rend(); ++iter, dindent += "  ") {
-        string index = (*iter)->str_gen();
-        out.dd << dindent << "for (auto& " << index << " : *" << (*iter)->generate_range("_") << ") {" << endl;
-        close2.push_back(dindent + "}");
-      }
+      out.dd << i->generate_prefetch(dindent, close2);
     } else {
-      int cnt = 0;
-      for (auto k = di.rbegin(); k != di.rend(); ++k, cnt++)
-        out.dd << dindent << "const Index " <<  (*k)->str_gen() << " = b(" << cnt << ");" << endl;
-      out.dd << endl;
-    }
+      if (ti.size() != 0) {
+        out.dd << endl;
+        for (auto iter = di.rbegin(); iter != di.rend(); ++iter, dindent += "  ") {
+          string index = (*iter)->str_gen();
+          out.dd << dindent << "for (auto& " << index << " : *" << (*iter)->generate_range("_") << ") {" << endl;
+          close2.push_back(dindent + "}");
+        }
+        if (screen_blocks && !di.empty())
+          out.dd << dindent << "if (" << i->generate_screening() << ") continue;" << endl;
+      } else {
+        int cnt = 0;
+        for (auto k = di.rbegin(); k != di.rend(); ++k, cnt++)
+          out.dd << dindent << "const Index " <<  (*k)->str_gen() << " = b(" << cnt << ");" << endl;
+        out.dd << endl;
+      }
 
-    // retrieving tensor_
-    out.dd << i->tensor()->generate_get_block(dindent, "i0", "in(0)");
-    out.dd << i->tensor()->generate_sort_indices(dindent, "i0", "in(0)", di) << endl;
-    // retrieving subtree_
-    string inlabel("in("); inlabel += (same_tensor__(i->tensor()->label(), i->next_target()->label()) ? "0)" : "1)");
-    out.dd << i->next_target()->generate_get_block(dindent, "i1", inlabel);
-    out.dd << i->next_target()->generate_sort_indices(dindent, "i1", inlabel, di) << endl;
+      // retrieving tensor_
+      out.dd << i->tensor()->generate_get_block(dindent, "i0", "in(0)");
+      out.dd << i->tensor()->generate_sort_indices(dindent, "i0", "in(0)", di) << endl;
+      // retrieving subtree_
+      string inlabel("in("); inlabel += (same_tensor__(i->tensor()->label(), i->next_target()->label()) ? "0)" : "1)");
+      out.dd << i->next_target()->generate_get_block(dindent, "i1", inlabel);
+      out.dd << i->next_target()->generate_sort_indices(dindent, "i1", inlabel, di) << endl;
+    }
 
     // call dgemm
     {
       pair<string, string> t0 = i->tensor()->generate_dim(di);
       pair<string, string> t1 = i->next_target()->generate_dim(di);
       if (t0.first != "" || t1.first != "") {
-        out.dd << dindent << GEMM << "(\"T\", \"N\", ";
         string tt0 = t0.first == "" ? "1" : t0.first;
         string tt1 = t1.first == "" ? "1" : t1.first;
         string ss0 = t1.second== "" ? "1" : t1.second;
+        const string beta = !overwrite ? "1.0" : (close2.empty() ? "0.0" : "beta");
+        // small all-active contractions are dispatched to compile-time sized kernels first
+        const string kernel = i->generate_active_kernel(tt0, tt1, ss0, beta);
+        const string gindent = kernel.empty() ? dindent : dindent + "  ";
+        if (!kernel.empty())
+          out.dd << dindent << kernel << endl;
+        out.dd << gindent << gemm__() << "(\"T\", \"N\", ";
         out.dd << tt0 << ", " << tt1 << ", " << ss0 << "," << endl;
-        out.dd << dindent << "       1.0, i0data_sorted, " << ss0 << ", i1data_sorted, " << ss0 << "," << endl
-           << dindent << "       1.0, odata_sorted, " << tt0;
+        out.dd << gindent << "       1.0, i0data_sorted, " << ss0 << ", i1data_sorted, " << ss0 << "," << endl
+           << gindent << "       " << beta << ", odata_sorted, " << tt0;
         out.dd << ");" << endl;
+        out.dd << profile_flops__(dindent, tt0, tt1, ss0);
+        if (overwrite && !close2.empty())
+          out.dd << dindent << "beta = 1.0;" << endl;
       } else {
         if (depth() != 1) {
           string ss0 = t1.second== "" ? "1" : t1.second;
           out.dd << dindent << "odata_sorted[0] += " << DOT << "(" << ss0 << ", i0data_sorted, 1, i1data_sorted, 1);" << endl;
+          out.dd << profile_flops__(dindent, "1", "1", ss0);
         } else {
           string ss0 = t1.second== "" ? "1" : t1.second;
           out.dd << dindent << "target_ += " << DOT << "(" << ss0 << ", i0data_sorted, 1, i1data_sorted, 1);" << endl;
+          out.dd << profile_flops__(dindent, "1", "1", ss0);
         }
       }
     }
@@ -272,9 +311,12 @@ OutStream Energy::generate_bc(const shared_ptr<BinaryContraction> i) const {
 
     // skip if energy tree depth is 1
     if (depth() != 1) {
+      // empty inner loops leave odata_sorted untouched
+      if (overwrite && !close2.empty())
+        out.dd << bindent << "if (beta == 0.0) std::fill_n(odata_sorted.get(), out()->get_size(" << target_->generate_block_index() << "), 0.0);" << endl;
       // sort buffer
       {
-        out.dd << i->target()->generate_sort_indices_target(bindent, "o", di, i->tensor(), i->next_target());
+        out.dd << i->target()->generate_sort_indices_target(bindent, "o", di, i->tensor(), i->next_target(), !overwrite);
       }
       // put buffer
       {
@@ -282,9 +324,11 @@ OutStream Energy::generate_bc(const shared_ptr<BinaryContraction> i) const {
         // new interface requires indices for put_block
         out.dd << bindent << "out()->add_block(odata";
         list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
+        string index;
         for (auto i = ti.rbegin(); i != ti.rend(); ++i)
-          out.dd << ", " << (*i)->str_gen();
-        out.dd << ");" << endl;
+          index += (index.empty() ? "" : ", ") + (*i)->str_gen();
+        out.dd << (index.empty() ? "" : ", ") << index << ");" << endl;
+        out.dd << profile_bytes__(bindent, "out()", index);
       }
     }
   } else {
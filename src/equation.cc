@@ -65,9 +65,9 @@ Equation::Equation(shared_ptr<Diagram> in, std::string nam) : name_(nam) {
     for (auto& i : diagram_) i->refresh_indices();
   }
 
-  // 4-external contributions are done through optimized code
+  // 4-external contributions are done through optimized code, unless they are generated (see four_external)
 #if defined(_RELMRCI) || defined(_MRCI)
-  for (auto it = diagram_.begin(); it != diagram_.end(); ) {
+  for (auto it = diagram_.begin(); it != diagram_.end() && !four_external; ) {
     bool four = false;
     for (auto& j : (*it)->op()) {
       if (j->op().size() != 4) continue;
@@ -24,6 +24,7 @@
 
 
 #include <tuple>
+#include <iomanip>
 #include "forest.h"
 #include "constants.h"
 
@@ -71,11 +72,37 @@ OutStream Forest::generate_code() const {
   out << generate_headers();
   out << generate_gammas();
 
-  for (auto& i : trees_) {
-    out.ss << "    std::shared_ptr<Queue> make_" << i->label() << "q(const bool reset = true, const bool diagonal = true);" << endl;
+  if (release_intermediates || memory_estimate) {
+    map<string, int> count;
+    for (auto& i : trees_)
+      i->count_consumers(count);
+    Tree::set_consumers(count);
+  }
 
-    out.ee << "shared_ptr<Queue> " << forest_name_ << "::" << forest_name_ << "::make_" << i->label() << "q(const bool reset, const bool diagonal) {" << endl << endl;
-    out.ee << "  array<shared_ptr<const IndexRange>,3> pindex = {{rclosed_, ractive_, rvirt_}};" << endl;
+  for (auto& i : trees_) {
+    out.ss << "    std::shared_ptr<Queue> make_" << i->label() << "q(const bool reset = true, const bool diagonal = true" << (state_batch ? ", std::shared_ptr<Queue> queue = nullptr" : "") << ");" << endl;
+    // state_batch limits the batches of state pairs of MRCI with the estimates
+    if (memory_estimate || (state_batch && (forest_name_ == "MRCI" || forest_name_ == "RelMRCI")))
+      out << generate_peak_memory(i);
+    if (state_batch && (forest_name_ == "MRCI" || forest_name_ == "RelMRCI"))
+      out << generate_gamma_memory(i);
+
+    out.ee << "shared_ptr<Queue> " << forest_name_ << "::" << forest_name_ << "::make_" << i->label() << "q(const bool reset, const bool diagonal" << (state_batch ? ", shared_ptr<Queue> queue" : "") << ") {" << endl << endl;
+    out.ee << "  array<shared_ptr<const IndexRange>," << nrange__() << "> pindex = {{rclosed_, ractive_, rvirt_" << (df_integrals ? ", raux_" : "") << "}};" << endl;
+    // the inputs may have changed since the last queue (e.g. amplitudes); norms are computed again by the tasks
+    if (screen_blocks)
+      out.ee << "  BlockNorms::get().clear();" << endl;
+    if (four_external)
+      out.ee << "  FourExternal::clear();" << endl;
+    if (balance_subtasks)
+      out.ee << "  SubtaskBalancer::reset();" << endl;
+    if (memory_estimate) {
+      out.ee << "  if (const char* budget = getenv(\"BAGEL_SMITH_MEMORY\")) {" << endl;
+      out.ee << "    const double peak = peak_memory_" << i->label() << "q() * sizeof(" << DataType << ") * 1.0e-9;" << endl;
+      out.ee << "    if (peak > atof(budget))" << endl;
+      out.ee << "      cout << \"  * warning: estimated peak memory of intermediates in " << i->label() << "q \" << setprecision(2) << peak << \" GB exceeds BAGEL_SMITH_MEMORY\" << endl;" << endl;
+      out.ee << "  }" << endl;
+    }
 
     tie(tmp, icnt, i0, itensors_) = i->generate_task_list(icnt, i0, gamma_, itensors_);
 
@@ -152,6 +179,8 @@ OutStream Forest::generate_headers() const {
   out.ss << "    void diagonal(std::shared_ptr<Tensor> r, std::shared_ptr<const Tensor> t) const;" << endl;
   out.ss << "" << endl;
 
+  if (memory_estimate || (state_batch && (forest_name_ == "MRCI" || forest_name_ == "RelMRCI")))
+    out.ee << "#include <cstdlib>" << endl;
   out.ee << "#include <src/util/math/davidson.h>" << endl;
   out.ee << "#include <src/smith/extrap.h>" << endl;
   out.ee << "#include <src/smith/" << forest_name_lower << "/" << forest_name_ << ".h>" << endl;
@@ -167,11 +196,97 @@ OutStream Forest::generate_headers() const {
   out.tt << "#include <src/smith/tensor.h>" << endl;
   out.tt << "#include <src/smith/task.h>" << endl;
   out.tt << "#include <src/smith/subtask.h>" << endl;
-  out.tt << "#include <src/smith/storage.h>" << endl << endl;
+  out.tt << "#include <src/smith/storage.h>" << endl;
+  if (prefetch_blocks || thread_accumulate)
+    out.tt << "#include <condition_variable>" << endl;
+  if (prefetch_blocks)
+    out.tt << "#include <deque>" << endl;
+  if (prefetch_blocks || thread_accumulate)
+    out.tt << "#include <functional>" << endl;
+  if (prefetch_blocks)
+    out.tt << "#include <future>" << endl;
+  if (scratch_pool || screen_blocks || profile_tasks || diagonal_fock || mixed_precision || thread_accumulate || four_external || reuse_queues)
+    out.tt << "#include <map>" << endl;
+  if (profile_tasks || diagonal_fock || prefetch_blocks || thread_accumulate || four_external)
+    out.tt << "#include <mutex>" << endl;
+  if (screen_blocks)
+    out.tt << "#include <limits>" << endl;
+  if (cost_table)
+    out.tt << "#include <cmath>" << endl;
+  if ((thread_accumulate || prefetch_blocks) && !profile_tasks)
+    out.tt << "#include <thread>" << endl;
+  if (profile_tasks) {
+    out.tt << "#include <chrono>" << endl;
+    out.tt << "#include <thread>" << endl;
+    out.tt << "#include <fstream>" << endl;
+    out.tt << "#include <iomanip>" << endl;
+    out.tt << "#include <iostream>" << endl;
+  }
+  if (profile_tasks || balance_subtasks || mixed_precision || thread_accumulate)
+    out.tt << "#include <algorithm>" << endl;
+  if (thread_accumulate) {
+    out.tt << "#include <src/util/parallel/resources.h>" << endl;
+    out.tt << "#ifdef HAVE_MKL_H" << endl;
+    out.tt << "#include <mkl_service.h>" << endl;
+    out.tt << "#endif" << endl;
+  }
+  if (gamma_cache) {
+    out.tt << "#include <cstdint>" << endl;
+    out.tt << "#include <cstdio>" << endl;
+  }
+  if (gamma_cache || four_external)
+    out.tt << "#include <cstdlib>" << endl;
+  if (gamma_cache) {
+    out.tt << "#include <sstream>" << endl;
+    out.tt << "#include <fcntl.h>" << endl;
+    out.tt << "#include <sys/mman.h>" << endl;
+    out.tt << "#include <unistd.h>" << endl;
+  }
+  if (gamma_cache || screen_blocks || fuse_update)
+    out.tt << "#include <src/smith/loopgenerator.h>" << endl;
+  if (profile_tasks || balance_subtasks || gamma_cache || screen_blocks || fuse_update)
+    out.tt << "#include <src/util/parallel/mpi_interface.h>" << endl;
+  out.tt << endl;
 
   out.tt << "namespace bagel {" << endl;
   out.tt << "namespace SMITH {" << endl;
   out.tt << "namespace " << forest_name_ << "{" << endl << endl;
+  // MixedPrecision takes its FP32 copies from the pool as well
+  if (scratch_pool || mixed_precision)
+    out.tt << generate_scratch_pool();
+  if (prefetch_blocks)
+    out.tt << generate_block_fetcher();
+  if (screen_blocks)
+    out.tt << generate_block_norms();
+  if (gamma_cache)
+    out.tt << generate_gamma_cache();
+  if (profile_tasks)
+    out.tt << generate_task_profile();
+  if (balance_subtasks)
+    out.tt << generate_subtask_balancer();
+  if (diagonal_fock)
+    out.tt << generate_fock_diagonal();
+  if (mixed_precision)
+    out.tt << generate_mixed_precision();
+  if (active_kernels)
+    out.tt << generate_active_kernel();
+  if (thread_accumulate)
+    out.tt << generate_block_accumulator();
+  if (four_external)
+    out.tt << generate_four_external();
+  if (fuse_update)
+    out.tt << generate_residual_update();
+  if (reuse_queues)
+    out.tt << generate_queue_replay();
+  if (cost_table) {
+    out.tt << generate_cost_descriptor();
+    IndexMap indmap;
+    out.kk << "# polynomials in the sizes of";
+    for (auto& i : indmap)
+      out.kk << " " << i.first;
+    out.kk << " (e.g. 2c2x = 2*c^2*x); inputs are separated by spaces; depth -1 denotes Gamma tasks" << endl;
+    out.kk << "task,depth,flops,out,in" << endl;
+  }
 
   out.cc << "#include <src/smith/" << forest_name_lower << "/" << forest_name_ << "_tasks.h>" << endl << endl;
   out.cc << "using namespace std;" << endl;
@@ -196,6 +311,884 @@ OutStream Forest::generate_headers() const {
 }
 
 
+string Forest::generate_scratch_pool() const {
+  stringstream tt;
+  tt << "// Scratch buffers binned by size (rounded up to a power of two). One pool per thread, reused across subtasks and iterations." << endl;
+  tt << "template<typename DataType>" << endl;
+  tt << "class ScratchPool {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::map<size_t, std::vector<std::unique_ptr<DataType[]>>> pool_;" << endl;
+  tt << "    static size_t size_class(const size_t size) { size_t n = 1; while (n < size) n <<= 1; return n; }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static ScratchPool<DataType>& pool() { static thread_local ScratchPool<DataType> p; return p; }" << endl << endl;
+  tt << "    std::unique_ptr<DataType[]> get(const size_t size) {" << endl;
+  tt << "      std::vector<std::unique_ptr<DataType[]>>& bin = pool_[size_class(size)];" << endl;
+  tt << "      if (bin.empty())" << endl;
+  tt << "        return std::unique_ptr<DataType[]>(new DataType[size_class(size)]);" << endl;
+  tt << "      std::unique_ptr<DataType[]> out = std::move(bin.back());" << endl;
+  tt << "      bin.pop_back();" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl;
+  tt << "    void put(std::unique_ptr<DataType[]>&& buf, const size_t size) {" << endl;
+  tt << "      if (buf) pool_[size_class(size)].push_back(std::move(buf));" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  tt << "// Fills data with a pooled buffer and hands it back to the pool when this goes out of scope." << endl;
+  tt << "template<typename DataType>" << endl;
+  tt << "class ScratchBuffer {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::unique_ptr<DataType[]>& data_;" << endl;
+  tt << "    const size_t size_;" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    ScratchBuffer(std::unique_ptr<DataType[]>& data, const size_t size) : data_(data), size_(size) {" << endl;
+  tt << "      data_ = ScratchPool<DataType>::pool().get(size_);" << endl;
+  tt << "    }" << endl;
+  tt << "    ~ScratchBuffer() { ScratchPool<DataType>::pool().put(std::move(data_), size_); }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_block_fetcher() const {
+  stringstream tt;
+  tt << "// Retrieves blocks for the prefetching inner loops on a background thread. One persistent thread per calling thread, so that" << endl;
+  tt << "// a prefetch costs a queue push rather than the creation of a thread." << endl;
+  tt << "class BlockFetcher {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::mutex mut_;" << endl;
+  tt << "    std::condition_variable cv_;" << endl;
+  tt << "    std::deque<std::function<void()>> jobs_;" << endl;
+  tt << "    bool stop_;" << endl;
+  tt << "    std::thread thread_;" << endl << endl;
+  tt << "    void loop() {" << endl;
+  tt << "      while (true) {" << endl;
+  tt << "        std::function<void()> job;" << endl;
+  tt << "        {" << endl;
+  tt << "          std::unique_lock<std::mutex> lock(mut_);" << endl;
+  tt << "          cv_.wait(lock, [this] { return stop_ || !jobs_.empty(); });" << endl;
+  tt << "          if (jobs_.empty()) return;" << endl;
+  tt << "          job = std::move(jobs_.front());" << endl;
+  tt << "          jobs_.pop_front();" << endl;
+  tt << "        }" << endl;
+  tt << "        job();" << endl;
+  tt << "      }" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    BlockFetcher() : stop_(false), thread_(&BlockFetcher::loop, this) { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    ~BlockFetcher() {" << endl;
+  tt << "      {" << endl;
+  tt << "        std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "        stop_ = true;" << endl;
+  tt << "      }" << endl;
+  tt << "      cv_.notify_one();" << endl;
+  tt << "      thread_.join();" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    static BlockFetcher& get() { static thread_local BlockFetcher f; return f; }" << endl << endl;
+  tt << "    template<typename F>" << endl;
+  tt << "    std::future<typename std::result_of<F()>::type> submit(F f) {" << endl;
+  tt << "      auto task = std::make_shared<std::packaged_task<typename std::result_of<F()>::type()>>(std::move(f));" << endl;
+  tt << "      std::future<typename std::result_of<F()>::type> out = task->get_future();" << endl;
+  tt << "      {" << endl;
+  tt << "        std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "        jobs_.push_back([task] { (*task)(); });" << endl;
+  tt << "      }" << endl;
+  tt << "      cv_.notify_one();" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_block_norms() const {
+  stringstream tt;
+  tt << "// Norms of tensor blocks used for screening. The norms of all blocks of an input are computed in one sweep over the local blocks" << endl;
+  tt << "// (and an allreduce) when the first task that reads it starts, and are kept until the queue is built again (once per iteration)." << endl;
+  tt << "// Only the tensor that a task writes to is forgotten after the task. Blocks that are not allocated have zero norm." << endl;
+  tt << "class BlockNorms {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    // keyed by the owner, so that a tensor allocated at the address of a released one does not find its norms" << endl;
+  tt << "    std::map<std::weak_ptr<const Tensor>, std::map<std::vector<size_t>, double>, std::owner_less<std::weak_ptr<const Tensor>>> norms_;" << endl;
+  tt << "    double thresh_;" << endl << endl;
+  tt << "    BlockNorms() : thresh_(" << scientific << setprecision(1) << screen_thresh << ") { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static BlockNorms& get() { static BlockNorms n; return n; }" << endl << endl;
+  tt << "    double thresh() const { return thresh_; }" << endl;
+  tt << "    void set_thresh(const double t) { thresh_ = t; }" << endl;
+  tt << "    void clear() { norms_.clear(); }" << endl;
+  tt << "    void erase(const std::shared_ptr<const Tensor>& t) { norms_.erase(t); }" << endl << endl;
+  tt << "    // collective; called by all processes from Task::compute_ before the subtasks run" << endl;
+  tt << "    void update(const std::shared_ptr<const Tensor>& t) {" << endl;
+  tt << "      if (norms_.count(t)) return;" << endl;
+  tt << "      for (auto i = norms_.begin(); i != norms_.end(); )" << endl;
+  tt << "        i = i->first.expired() ? norms_.erase(i) : ++i;" << endl;
+  tt << "      std::vector<std::vector<size_t>> keys;" << endl;
+  tt << "      std::vector<double> norm;" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(t->indexrange())) {" << endl;
+  tt << "        std::vector<size_t> key;" << endl;
+  tt << "        for (auto& i : b)" << endl;
+  tt << "          key.push_back(i.key());" << endl;
+  tt << "        double sum = 0.0;" << endl;
+  tt << "        const size_t size = t->get_size_alloc(b);" << endl;
+  tt << "        if (size && t->is_local(b)) {" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> data = t->get_block(b);" << endl;
+  tt << "          for (size_t i = 0; i != size; ++i)" << endl;
+  tt << "            sum += std::norm(data[i]);" << endl;
+  tt << "        }" << endl;
+  tt << "        keys.push_back(key);" << endl;
+  tt << "        norm.push_back(sum);" << endl;
+  tt << "      }" << endl;
+  tt << "      if (!norm.empty())" << endl;
+  tt << "        mpi__->allreduce(norm.data(), norm.size());" << endl;
+  tt << "      std::map<std::vector<size_t>, double>& table = norms_[t];" << endl;
+  tt << "      for (size_t i = 0; i != keys.size(); ++i)" << endl;
+  tt << "        table.emplace(keys[i], std::sqrt(norm[i]));" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // read-only, so that subtasks on several threads can look up norms" << endl;
+  tt << "    template<typename... args>" << endl;
+  tt << "    double norm(const std::shared_ptr<const Tensor>& t, const args&... index) const {" << endl;
+  tt << "      auto iter = norms_.find(t);" << endl;
+  tt << "      // not screened if update() has not been called" << endl;
+  tt << "      if (iter == norms_.end()) return std::numeric_limits<double>::max();" << endl;
+  tt << "      auto block = iter->second.find(std::vector<size_t>{index.key()...});" << endl;
+  tt << "      return block != iter->second.end() ? block->second : 0.0;" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_task_profile() const {
+  stringstream tt;
+  tt << "// Wall time, flops and bytes moved through get_block/add_block of each task. Counters are thread local, as subtasks run" << endl;
+  tt << "// on the thread that computes the task. Every run is also kept as an event for a Chrome trace (chrome://tracing)." << endl;
+  tt << "class TaskProfile {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    using clock = std::chrono::steady_clock;" << endl;
+  tt << "    struct Entry { size_t calls = 0; double time = 0.0, flops = 0.0, bytes = 0.0; };" << endl;
+  tt << "    struct Event { std::string name; size_t thread; double start, duration; };" << endl;
+  tt << "    std::map<std::string, Entry> entries_;" << endl;
+  tt << "    std::vector<Event> events_;" << endl;
+  tt << "    std::map<std::thread::id, size_t> threads_;" << endl;
+  tt << "    std::mutex mut_;" << endl;
+  tt << "    const clock::time_point origin_;" << endl << endl;
+  tt << "    TaskProfile() : origin_(clock::now()) { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static TaskProfile& get() { static TaskProfile p; return p; }" << endl;
+  tt << "    static double& flops() { thread_local double f = 0.0; return f; }" << endl;
+  tt << "    static double& bytes() { thread_local double b = 0.0; return b; }" << endl << endl;
+  tt << "    // records a run of a task from construction to destruction" << endl;
+  tt << "    class Scope {" << endl;
+  tt << "      protected:" << endl;
+  tt << "        TaskProfile& profile_;" << endl;
+  tt << "        const std::string name_;" << endl;
+  tt << "        const clock::time_point start_;" << endl;
+  tt << "      public:" << endl;
+  tt << "        Scope(const std::string& name) : profile_(TaskProfile::get()), name_(name), start_(clock::now()) { flops() = 0.0; bytes() = 0.0; }" << endl;
+  tt << "        ~Scope() { profile_.add(name_, start_, clock::now()); }" << endl;
+  tt << "    };" << endl << endl;
+  tt << "    void add(const std::string& name, const clock::time_point& start, const clock::time_point& end) {" << endl;
+  tt << "      const double duration = std::chrono::duration<double>(end - start).count();" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "      Entry& entry = entries_[name];" << endl;
+  tt << "      ++entry.calls;" << endl;
+  tt << "      entry.time += duration;" << endl;
+  tt << "      entry.flops += flops();" << endl;
+  tt << "      entry.bytes += bytes();" << endl;
+  tt << "      const size_t thread = threads_.emplace(std::this_thread::get_id(), threads_.size()).first->second;" << endl;
+  tt << "      events_.push_back({name, thread, std::chrono::duration<double, std::micro>(start - origin_).count(), duration*1.0e6});" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // prints the n tasks that took the longest on this process" << endl;
+  tt << "    void report(const size_t n = 20) {" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "      std::vector<std::pair<std::string, Entry>> sorted(entries_.begin(), entries_.end());" << endl;
+  tt << "      std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, Entry>& a, const std::pair<std::string, Entry>& b) { return a.second.time > b.second.time; });" << endl;
+  tt << "      double total = 0.0;" << endl;
+  tt << "      for (auto& i : sorted)" << endl;
+  tt << "        total += i.second.time;" << endl;
+  tt << "      std::cout << \"    * hot tasks on process \" << mpi__->rank() << \" (\" << std::fixed << std::setprecision(2) << total << \" sec in total)\" << std::endl;" << endl;
+  tt << "      std::cout << \"      \" << std::setw(10) << \"task\" << std::setw(8) << \"calls\" << std::setw(10) << \"sec\" << std::setw(8) << \"%\"" << endl;
+  tt << "                << std::setw(10) << \"GFLOP\" << std::setw(10) << \"GFLOP/s\" << std::setw(10) << \"GB\" << std::endl;" << endl;
+  tt << "      for (size_t i = 0; i != std::min(n, sorted.size()); ++i) {" << endl;
+  tt << "        const Entry& e = sorted[i].second;" << endl;
+  tt << "        std::cout << \"      \" << std::setw(10) << sorted[i].first << std::setw(8) << e.calls << std::setw(10) << e.time" << endl;
+  tt << "                  << std::setw(8) << (total > 0.0 ? e.time / total * 100.0 : 0.0) << std::setw(10) << e.flops * 1.0e-9" << endl;
+  tt << "                  << std::setw(10) << (e.time > 0.0 ? e.flops / e.time * 1.0e-9 : 0.0) << std::setw(10) << e.bytes * 1.0e-9 << std::endl;" << endl;
+  tt << "      }" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // writes the events to prefix_rank.json in the Chrome trace format" << endl;
+  tt << "    void write_trace(const std::string& prefix) {" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "      std::ofstream ofs(prefix + \"_\" + std::to_string(mpi__->rank()) + \".json\");" << endl;
+  tt << "      ofs << \"{\\\"traceEvents\\\":[\" << std::fixed << std::setprecision(1);" << endl;
+  tt << "      for (auto i = events_.begin(); i != events_.end(); ++i)" << endl;
+  tt << "        ofs << (i != events_.begin() ? \",\" : \"\") << std::endl << \"{\\\"name\\\":\\\"\" << i->name << \"\\\",\\\"ph\\\":\\\"X\\\",\\\"pid\\\":\" << mpi__->rank()" << endl;
+  tt << "            << \",\\\"tid\\\":\" << i->thread << \",\\\"ts\\\":\" << i->start << \",\\\"dur\\\":\" << i->duration << \"}\";" << endl;
+  tt << "      ofs << std::endl << \"]}\" << std::endl;" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_subtask_balancer() const {
+  stringstream tt;
+  tt << "// Assigns the block tuples of a task to processes in place of the owner of the output block. The cost of a tuple is the product" << endl;
+  tt << "// of its block sizes (inner loops are common to all tuples), and each tuple goes to the process with the least cost so far." << endl;
+  tt << "// The loads are carried over from task to task within a queue (reset when the queue is built), so that tasks with fewer tuples" << endl;
+  tt << "// than processes are spread out rather than all placed on the first processes. All processes construct the tasks in the same" << endl;
+  tt << "// order and thus make the same assignment; results are added to remote blocks." << endl;
+  tt << "class SubtaskBalancer {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    static std::vector<double>& load() { static std::vector<double> l(mpi__->size(), 0.0); return l; }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static void reset() { std::fill(load().begin(), load().end(), 0.0); }" << endl << endl;
+  tt << "    template<typename... args>" << endl;
+  tt << "    bool take(const args&... index) {" << endl;
+  tt << "      const size_t size[] = {1lu, index.size()...};" << endl;
+  tt << "      double cost = 1.0;" << endl;
+  tt << "      for (auto& i : size)" << endl;
+  tt << "        cost *= i;" << endl;
+  tt << "      std::vector<double>& l = load();" << endl;
+  tt << "      auto iter = std::min_element(l.begin(), l.end());" << endl;
+  tt << "      *iter += cost;" << endl;
+  tt << "      return iter - l.begin() == mpi__->rank();" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_fock_diagonal() const {
+  stringstream tt;
+  tt << "// Whether f1 is diagonal over a block range, as with canonical orbitals. Checked once per tensor and range, reading every block" << endl;
+  tt << "// pair of the range; tasks contract diagonal ranges elementwise and otherwise use dgemm. Cleared when f1 is rebuilt." << endl;
+  tt << "class FockDiagonal {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::map<std::pair<const Tensor*, const IndexRange*>, bool> diagonal_;" << endl;
+  tt << "    std::mutex mut_;" << endl;
+  tt << "    double thresh_;" << endl << endl;
+  tt << "    FockDiagonal() : thresh_(1.0e-10) { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static FockDiagonal& get() { static FockDiagonal f; return f; }" << endl << endl;
+  tt << "    double thresh() const { return thresh_; }" << endl;
+  tt << "    void set_thresh(const double t) { thresh_ = t; }" << endl;
+  tt << "    void clear() { std::lock_guard<std::mutex> lock(mut_); diagonal_.clear(); }" << endl << endl;
+  tt << "    bool diagonal(const std::shared_ptr<const Tensor>& f, const IndexRange& range) {" << endl;
+  tt << "      const auto key = std::make_pair(f.get(), &range);" << endl;
+  tt << "      {" << endl;
+  tt << "        std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "        auto iter = diagonal_.find(key);" << endl;
+  tt << "        if (iter != diagonal_.end()) return iter->second;" << endl;
+  tt << "      }" << endl;
+  tt << "      bool out = true;" << endl;
+  tt << "      for (auto& i1 : range)" << endl;
+  tt << "        for (auto& i0 : range) {" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> data = f->get_block(i0, i1);" << endl;
+  tt << "          for (size_t j1 = 0; j1 != i1.size(); ++j1)" << endl;
+  tt << "            for (size_t j0 = 0; j0 != i0.size(); ++j0)" << endl;
+  tt << "              if ((i0.key() != i1.key() || j0 != j1) && std::abs(data[j0+i0.size()*j1]) > thresh_)" << endl;
+  tt << "                out = false;" << endl;
+  tt << "        }" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "      diagonal_.emplace(key, out);" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_mixed_precision() const {
+  const string low = DataType == "double" ? "float" : "std::complex<float>";
+  const string lowgemm = DataType == "double" ? "sgemm_" : "cgemm_";
+  stringstream tt;
+  tt << "extern \"C\" {" << endl;
+  tt << "  void " << lowgemm << "(const char*, const char*, const int*, const int*, const int*, const " << low << "*, const " << low << "*, const int*," << endl;
+  tt << "  " << string(lowgemm.size()+6, ' ') << "const " << low << "*, const int*, const " << low << "*, " << low << "*, const int*);" << endl;
+  tt << "}" << endl << endl;
+  tt << "// Contractions of the tasks. In single precision, operand blocks are rounded to FP32 and multiplied with " << lowgemm << ", and the product" << endl;
+  tt << "// is added to the FP64 output block. The driver computes residuals in single precision until their norm falls below thresh()" << endl;
+  tt << "// and then switches to dgemm, so that the converged amplitudes are refined in double precision." << endl;
+  tt << "class MixedPrecision {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    bool single_;" << endl;
+  tt << "    double thresh_;" << endl << endl;
+  tt << "    MixedPrecision() : single_(false), thresh_(" << scientific << setprecision(1) << mixed_thresh << ") { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static MixedPrecision& get() { static MixedPrecision m; return m; }" << endl << endl;
+  tt << "    bool single() const { return single_; }" << endl;
+  tt << "    void set_single(const bool s) { single_ = s; }" << endl;
+  tt << "    double thresh() const { return thresh_; }" << endl;
+  tt << "    void set_thresh(const double t) { thresh_ = t; }" << endl << endl;
+  tt << "    void gemm(const char* transa, const char* transb, const int m, const int n, const int k, const " << DataType << " alpha," << endl;
+  tt << "              const std::unique_ptr<" << DataType << "[]>& a, const int lda, const std::unique_ptr<" << DataType << "[]>& b, const int ldb," << endl;
+  tt << "              const " << DataType << " beta, std::unique_ptr<" << DataType << "[]>& c, const int ldc) const {" << endl;
+  tt << "      if (!single_) {" << endl;
+  tt << "        " << GEMM << "(transa, transb, m, n, k, alpha, a, lda, b, ldb, beta, c, ldc);" << endl;
+  tt << "        return;" << endl;
+  tt << "      }" << endl;
+  tt << "      const size_t asize = static_cast<size_t>(lda) * (*transa == 'N' ? k : m);" << endl;
+  tt << "      const size_t bsize = static_cast<size_t>(ldb) * (*transb == 'N' ? n : k);" << endl;
+  tt << "      // FP32 copies in buffers of the thread's pool, which are allocated once for the largest blocks and then reused" << endl;
+  tt << "      std::unique_ptr<" << low << "[]> as, bs, cs;" << endl;
+  tt << "      ScratchBuffer<" << low << "> abuf(as, asize);" << endl;
+  tt << "      ScratchBuffer<" << low << "> bbuf(bs, bsize);" << endl;
+  tt << "      ScratchBuffer<" << low << "> cbuf(cs, static_cast<size_t>(m)*n);" << endl;
+  tt << "      std::copy_n(a.get(), asize, as.get());" << endl;
+  tt << "      std::copy_n(b.get(), bsize, bs.get());" << endl;
+  tt << "      const " << low << " lalpha(alpha);" << endl;
+  tt << "      const " << low << " lzero(0.0);" << endl;
+  tt << "      " << lowgemm << "(transa, transb, &m, &n, &k, &lalpha, as.get(), &lda, bs.get(), &ldb, &lzero, cs.get(), &m);" << endl;
+  tt << "      for (int j = 0; j != n; ++j)" << endl;
+  tt << "        for (int i = 0; i != m; ++i)" << endl;
+  tt << "          c[i+static_cast<size_t>(ldc)*j] = (beta == 0.0 ? 0.0 : beta*c[i+static_cast<size_t>(ldc)*j]) + " << DataType << "(cs[i+static_cast<size_t>(m)*j]);" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_active_kernel() const {
+  stringstream tt;
+  tt << "// Contractions of all-active blocks, odata(M,N) = beta*odata + i0(K,M)^T i1(K,N) with M = x^P, N = x^Q and K = x^R for active blocks" << endl;
+  tt << "// of x orbitals. The sizes are compile-time constants, so that the loops are unrolled and vectorized without the overhead" << endl;
+  tt << "// of a BLAS call. gemm() returns false, and the caller uses dgemm, for blocks of different sizes or larger than " << active_kernel_max << "." << endl;
+  tt << "template<int P, int Q, int R>" << endl;
+  tt << "class ActiveKernel {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    static constexpr size_t power(const size_t x, const int p) { return p == 0 ? 1 : x*power(x, p-1); }" << endl << endl;
+  tt << "    template<size_t X>" << endl;
+  tt << "    static void kernel(const " << DataType << "* a, const " << DataType << "* b, const " << DataType << " beta, " << DataType << "* c) {" << endl;
+  tt << "      constexpr size_t M = power(X, P);" << endl;
+  tt << "      constexpr size_t N = power(X, Q);" << endl;
+  tt << "      constexpr size_t K = power(X, R);" << endl;
+  tt << "      for (size_t j = 0; j != N; ++j)" << endl;
+  tt << "        for (size_t i = 0; i != M; ++i) {" << endl;
+  tt << "          " << DataType << " sum = 0.0;" << endl;
+  tt << "          for (size_t l = 0; l != K; ++l)" << endl;
+  tt << "            sum += a[l+K*i] * b[l+K*j];" << endl;
+  tt << "          c[i+M*j] = beta == 0.0 ? sum : beta*c[i+M*j] + sum;" << endl;
+  tt << "        }" << endl;
+  tt << "    }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static bool gemm(const size_t x, const size_t m, const size_t n, const size_t k, const std::unique_ptr<" << DataType << "[]>& a," << endl;
+  tt << "                     const std::unique_ptr<" << DataType << "[]>& b, const " << DataType << " beta, std::unique_ptr<" << DataType << "[]>& c) {" << endl;
+  tt << "      if (m != power(x, P) || n != power(x, Q) || k != power(x, R))" << endl;
+  tt << "        return false;" << endl;
+  tt << "      switch (x) {" << endl;
+  for (int x = 1; x <= active_kernel_max; ++x)
+    tt << "        case " << x << ": kernel<" << x << ">(a.get(), b.get(), beta, c.get()); return true;" << endl;
+  tt << "        default: return false;" << endl;
+  tt << "      }" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_block_accumulator() const {
+  stringstream tt;
+  tt << "// Private accumulation of output blocks. Subtasks of a task run on several threads, and each thread adds its output blocks" << endl;
+  tt << "// to private buffers instead of the target. The buffers are then reduced in parallel, every block by one thread and with" << endl;
+  tt << "// one add_block, so that threads do not contend for hot target blocks (r, den1, den2, ...). Outside run(), add() calls add_block." << endl;
+  tt << "// The threads are a pool that lives as long as the program, so that their thread-local state (e.g., ScratchPool) is kept" << endl;
+  tt << "// from task to task. BLAS runs single-threaded inside run() with MKL; other libraries have to be limited by the user." << endl;
+  tt << "class BlockAccumulator {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    struct Block {" << endl;
+  tt << "      std::vector<Index> index;" << endl;
+  tt << "      size_t size;" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> data;" << endl;
+  tt << "    };" << endl;
+  tt << "    std::map<std::vector<size_t>, Block> blocks_;" << endl << endl;
+  tt << "    static BlockAccumulator*& current() { static thread_local BlockAccumulator* c = nullptr; return c; }" << endl << endl;
+  tt << "    class Pool {" << endl;
+  tt << "      protected:" << endl;
+  tt << "        std::mutex mut_;" << endl;
+  tt << "        std::condition_variable start_;" << endl;
+  tt << "        std::condition_variable done_;" << endl;
+  tt << "        std::function<void(const size_t)> job_;" << endl;
+  tt << "        size_t njob_ = 0;" << endl;
+  tt << "        size_t running_ = 0;" << endl;
+  tt << "        size_t generation_ = 0;" << endl;
+  tt << "        bool stop_ = false;" << endl;
+  tt << "        std::vector<std::thread> threads_;" << endl << endl;
+  tt << "        void loop(const size_t t) {" << endl;
+  tt << "#ifdef HAVE_MKL_H" << endl;
+  tt << "          mkl_set_num_threads_local(1);" << endl;
+  tt << "#endif" << endl;
+  tt << "          size_t seen = 0;" << endl;
+  tt << "          while (true) {" << endl;
+  tt << "            {" << endl;
+  tt << "              std::unique_lock<std::mutex> lock(mut_);" << endl;
+  tt << "              start_.wait(lock, [this, &seen] { return stop_ || generation_ != seen; });" << endl;
+  tt << "              if (stop_) return;" << endl;
+  tt << "              seen = generation_;" << endl;
+  tt << "              if (t >= njob_) continue;" << endl;
+  tt << "            }" << endl;
+  tt << "            job_(t);" << endl;
+  tt << "            std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "            if (--running_ == 0)" << endl;
+  tt << "              done_.notify_one();" << endl;
+  tt << "          }" << endl;
+  tt << "        }" << endl << endl;
+  tt << "      public:" << endl;
+  tt << "        Pool(const size_t n) {" << endl;
+  tt << "          for (size_t t = 1; t < n; ++t)" << endl;
+  tt << "            threads_.emplace_back(&Pool::loop, this, t);" << endl;
+  tt << "        }" << endl;
+  tt << "        ~Pool() {" << endl;
+  tt << "          {" << endl;
+  tt << "            std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "            stop_ = true;" << endl;
+  tt << "          }" << endl;
+  tt << "          start_.notify_all();" << endl;
+  tt << "          for (auto& i : threads_) i.join();" << endl;
+  tt << "        }" << endl << endl;
+  tt << "        size_t size() const { return threads_.size()+1; }" << endl << endl;
+  tt << "        // calls job(t) for t < n, job(0) on the calling thread, and returns when all calls have returned" << endl;
+  tt << "        void run(const size_t n, std::function<void(const size_t)> job) {" << endl;
+  tt << "          {" << endl;
+  tt << "            std::lock_guard<std::mutex> lock(mut_);" << endl;
+  tt << "            job_ = std::move(job);" << endl;
+  tt << "            njob_ = n;" << endl;
+  tt << "            running_ = n-1;" << endl;
+  tt << "            ++generation_;" << endl;
+  tt << "          }" << endl;
+  tt << "          start_.notify_all();" << endl;
+  tt << "          job_(0);" << endl;
+  tt << "          std::unique_lock<std::mutex> lock(mut_);" << endl;
+  tt << "          done_.wait(lock, [this] { return running_ == 0; });" << endl;
+  tt << "        }" << endl;
+  tt << "    };" << endl;
+  tt << "    static Pool& pool() { static Pool p(resources__->max_num_threads()); return p; }" << endl << endl;
+  tt << "    static size_t owner(const std::vector<size_t>& key, const size_t n) {" << endl;
+  tt << "      size_t out = 0;" << endl;
+  tt << "      for (auto& i : key)" << endl;
+  tt << "        out = out*31 + i;" << endl;
+  tt << "      return out % n;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    template<class T, typename... args>" << endl;
+  tt << "    static void add(const T& out, const std::unique_ptr<" << DataType << "[]>& data, const args&... index) {" << endl;
+  tt << "      BlockAccumulator* acc = current();" << endl;
+  tt << "      if (!acc) {" << endl;
+  tt << "        out->add_block(data, index...);" << endl;
+  tt << "        return;" << endl;
+  tt << "      }" << endl;
+  tt << "      const size_t sizes[] = {1lu, index.size()...};" << endl;
+  tt << "      size_t size = 1;" << endl;
+  tt << "      for (auto& i : sizes)" << endl;
+  tt << "        size *= i;" << endl;
+  tt << "      Block& block = acc->blocks_[std::vector<size_t>{index.key()...}];" << endl;
+  tt << "      if (!block.data) {" << endl;
+  tt << "        block.index = std::vector<Index>{index...};" << endl;
+  tt << "        block.size = size;" << endl;
+  tt << "        block.data.reset(new " << DataType << "[size]);" << endl;
+  tt << "        std::copy_n(data.get(), size, block.data.get());" << endl;
+  tt << "      } else {" << endl;
+  tt << "        for (size_t i = 0; i != size; ++i)" << endl;
+  tt << "          block.data[i] += data[i];" << endl;
+  tt << "      }" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    template<class S, class T>" << endl;
+  tt << "    static void run(std::vector<std::shared_ptr<S>>& subtasks, const T& out) {" << endl;
+  tt << "      const size_t nthread = std::min<size_t>(pool().size(), subtasks.size());" << endl;
+  tt << "      if (nthread <= 1) {" << endl;
+  tt << "        for (auto& i : subtasks) i->compute();" << endl;
+  tt << "        return;" << endl;
+  tt << "      }" << endl;
+  tt << "      std::vector<BlockAccumulator> acc(nthread);" << endl;
+  tt << "#ifdef HAVE_MKL_H" << endl;
+  tt << "      const int nblas = mkl_set_num_threads_local(1);" << endl;
+  tt << "#endif" << endl;
+  tt << "      pool().run(nthread, [&](const size_t t) {" << endl;
+  tt << "        current() = &acc[t];" << endl;
+  tt << "        for (size_t i = t; i < subtasks.size(); i += nthread)" << endl;
+  tt << "          subtasks[i]->compute();" << endl;
+  tt << "        current() = nullptr;" << endl;
+  tt << "      });" << endl << endl;
+  tt << "      pool().run(nthread, [&](const size_t t) {" << endl;
+  tt << "        std::map<std::vector<size_t>, Block*> sum;" << endl;
+  tt << "        for (auto& a : acc)" << endl;
+  tt << "          for (auto& block : a.blocks_) {" << endl;
+  tt << "            if (owner(block.first, nthread) != t) continue;" << endl;
+  tt << "            auto iter = sum.find(block.first);" << endl;
+  tt << "            if (iter == sum.end()) {" << endl;
+  tt << "              sum.emplace(block.first, &block.second);" << endl;
+  tt << "            } else {" << endl;
+  tt << "              for (size_t i = 0; i != block.second.size; ++i)" << endl;
+  tt << "                iter->second->data[i] += block.second.data[i];" << endl;
+  tt << "            }" << endl;
+  tt << "          }" << endl;
+  tt << "        for (auto& block : sum)" << endl;
+  tt << "          out->add_block(block.second->data, block.second->index);" << endl;
+  tt << "      });" << endl;
+  tt << "#ifdef HAVE_MKL_H" << endl;
+  tt << "      mkl_set_num_threads_local(nblas);" << endl;
+  tt << "#endif" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_four_external() const {
+  stringstream tt;
+  tt << "// Blocks of the 4-external integrals, (i0 i1|i2 i3) = sum_P (P|i0 i1)(P|i2 i3), formed from the DF integrals when a task" << endl;
+  tt << "// retrieves them, so that all-virtual v2 is never stored. The auxiliary blocks are stacked and contracted with one gemm." << endl;
+  tt << "// Formed blocks are kept until the next queue is built, up to a memory budget, since tasks request each of them repeatedly." << endl;
+  tt << "class FourExternal {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::mutex mut_;" << endl;
+  tt << "    // blocks formed since the last clear(), as long as they fit in capacity_ elements (BAGEL_FOUR_EXTERNAL_CACHE in GB, default 1)" << endl;
+  tt << "    std::map<std::weak_ptr<const Tensor>, std::map<std::vector<size_t>, std::unique_ptr<" << DataType << "[]>>, std::owner_less<std::weak_ptr<const Tensor>>> blocks_;" << endl;
+  tt << "    size_t size_ = 0;" << endl;
+  tt << "    size_t capacity_;" << endl;
+  if (screen_blocks) {
+    tt << "    // sum_P |(P|i0 i1)|^2, computed once for each pair of blocks of the (constant) DF integrals" << endl;
+    tt << "    std::map<std::weak_ptr<const Tensor>, std::map<std::vector<size_t>, double>, std::owner_less<std::weak_ptr<const Tensor>>> pairs_;" << endl;
+  }
+  tt << endl;
+  tt << "    FourExternal() {" << endl;
+  tt << "      const char* c = std::getenv(\"BAGEL_FOUR_EXTERNAL_CACHE\");" << endl;
+  tt << "      capacity_ = (c ? std::atof(c) : 1.0) * 1.0e9 / sizeof(" << DataType << ");" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    static FourExternal& get() { static FourExternal f; return f; }" << endl << endl;
+  tt << "    // (P|i0 i1) for all P as a matrix with P running fastest" << endl;
+  tt << "    static std::unique_ptr<" << DataType << "[]> stack(const std::shared_ptr<const Tensor>& df, const IndexRange& aux, const Index& i0, const Index& i1) {" << endl;
+  tt << "      const size_t naux = aux.size();" << endl;
+  tt << "      const size_t n = i0.size()*i1.size();" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> out(new " << DataType << "[naux*n]);" << endl;
+  tt << "      size_t offset = 0;" << endl;
+  tt << "      for (auto& p : aux) {" << endl;
+  tt << "        std::unique_ptr<" << DataType << "[]> data = df->get_block(p, i0, i1);" << endl;
+  tt << "        for (size_t i = 0; i != n; ++i)" << endl;
+  tt << "          std::copy_n(data.get()+p.size()*i, p.size(), out.get()+offset+naux*i);" << endl;
+  tt << "        offset += p.size();" << endl;
+  tt << "      }" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    static std::unique_ptr<" << DataType << "[]> form(const std::shared_ptr<const Tensor>& df, const Index& i0, const Index& i1, const Index& i2, const Index& i3) {" << endl;
+  tt << "      const IndexRange aux = df->indexrange()[0];" << endl;
+  tt << "      const size_t naux = aux.size();" << endl;
+  tt << "      const size_t m = i0.size()*i1.size();" << endl;
+  tt << "      const size_t n = i2.size()*i3.size();" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> left = stack(df, aux, i0, i1);" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> right = stack(df, aux, i2, i3);" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> out(new " << DataType << "[m*n]);" << endl;
+  tt << "      " << GEMM << "(\"T\", \"N\", m, n, naux, 1.0, left, naux, right, naux, 0.0, out, m);" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl;
+  if (screen_blocks) {
+    tt << endl;
+    tt << "    double pair(const std::shared_ptr<const Tensor>& df, const Index& i0, const Index& i1) {" << endl;
+    tt << "      const std::vector<size_t> key{i0.key(), i1.key()};" << endl;
+    tt << "      {" << endl;
+    tt << "        std::lock_guard<std::mutex> lock(mut_);" << endl;
+    tt << "        auto iter = pairs_[df].find(key);" << endl;
+    tt << "        if (iter != pairs_[df].end())" << endl;
+    tt << "          return iter->second;" << endl;
+    tt << "      }" << endl;
+    tt << "      double out = 0.0;" << endl;
+    tt << "      const IndexRange aux = df->indexrange()[0];" << endl;
+    tt << "      for (auto& p : aux)" << endl;
+    tt << "        out += std::pow(BlockNorms::get().norm(df, p, i0, i1), 2);" << endl;
+    tt << "      // not stored before the norms of df are computed (see BlockNorms::norm)" << endl;
+    tt << "      if (out < std::numeric_limits<double>::max()) {" << endl;
+    tt << "        std::lock_guard<std::mutex> lock(mut_);" << endl;
+    tt << "        pairs_[df].emplace(key, out);" << endl;
+    tt << "      }" << endl;
+    tt << "      return out;" << endl;
+    tt << "    }" << endl;
+  }
+  tt << endl;
+  tt << "  public:" << endl;
+  tt << "    // drops the stored blocks; called when queues are built" << endl;
+  tt << "    static void clear() {" << endl;
+  tt << "      FourExternal& f = get();" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(f.mut_);" << endl;
+  tt << "      f.blocks_.clear();" << endl;
+  tt << "      f.size_ = 0;" << endl;
+  if (screen_blocks) {
+    tt << "      for (auto i = f.pairs_.begin(); i != f.pairs_.end(); )" << endl;
+    tt << "        i = i->first.expired() ? f.pairs_.erase(i) : ++i;" << endl;
+  }
+  tt << "    }" << endl << endl;
+  tt << "    // the same block is requested for every block of the other indices of a task; it is formed once and then copied" << endl;
+  tt << "    static std::unique_ptr<" << DataType << "[]> get_block(const std::shared_ptr<const Tensor>& df, const Index& i0, const Index& i1, const Index& i2, const Index& i3) {" << endl;
+  tt << "      FourExternal& f = get();" << endl;
+  tt << "      const std::vector<size_t> key{i0.key(), i1.key(), i2.key(), i3.key()};" << endl;
+  tt << "      const size_t size = i0.size()*i1.size()*i2.size()*i3.size();" << endl;
+  tt << "      std::unique_ptr<" << DataType << "[]> out;" << endl;
+  tt << "      {" << endl;
+  tt << "        std::lock_guard<std::mutex> lock(f.mut_);" << endl;
+  tt << "        auto iter = f.blocks_[df].find(key);" << endl;
+  tt << "        if (iter != f.blocks_[df].end()) {" << endl;
+  tt << "          out.reset(new " << DataType << "[size]);" << endl;
+  tt << "          std::copy_n(iter->second.get(), size, out.get());" << endl;
+  tt << "          return out;" << endl;
+  tt << "        }" << endl;
+  tt << "      }" << endl;
+  tt << "      out = form(df, i0, i1, i2, i3);" << endl;
+  tt << "      std::lock_guard<std::mutex> lock(f.mut_);" << endl;
+  tt << "      if (f.size_ + size <= f.capacity_ && !f.blocks_[df].count(key)) {" << endl;
+  tt << "        std::unique_ptr<" << DataType << "[]> copy(new " << DataType << "[size]);" << endl;
+  tt << "        std::copy_n(out.get(), size, copy.get());" << endl;
+  tt << "        f.blocks_[df].emplace(key, std::move(copy));" << endl;
+  tt << "        f.size_ += size;" << endl;
+  tt << "      }" << endl;
+  tt << "      return out;" << endl;
+  tt << "    }" << endl;
+  if (screen_blocks) {
+    tt << endl;
+    tt << "    // bound on the Frobenius norm of a product, |(i0 i1|i2 i3)| <= |(P|i0 i1)| |(P|i2 i3)|" << endl;
+    tt << "    static double norm(const std::shared_ptr<const Tensor>& df, const Index& i0, const Index& i1, const Index& i2, const Index& i3) {" << endl;
+    tt << "      return std::sqrt(get().pair(df, i0, i1) * get().pair(df, i2, i3));" << endl;
+    tt << "    }" << endl;
+  }
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_residual_update() const {
+  stringstream tt;
+  tt << "// Sweeps over the local blocks of the residual in the CASPT2 driver. r is seeded with 2s before the residual tasks accumulate" << endl;
+  tt << "// into it, so that the energy s.t2 + (r+s).t2 is a single dot_product_transpose(r, t2) (linear in r). Removing the extra s" << endl;
+  tt << "// and computing the rms are then done in one sweep, instead of separate zero, ax_plus_y, dot product and rms sweeps." << endl;
+  tt << "class ResidualUpdate {" << endl;
+  tt << "  public:" << endl;
+  tt << "    // r = a*s; blocks that are not allocated (outside the excitation space) are skipped" << endl;
+  tt << "    static void seed(std::shared_ptr<Tensor> r, std::shared_ptr<const Tensor> s, const double a) {" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(r->indexrange()))" << endl;
+  tt << "        if (r->get_size_alloc(b) && r->is_local(b)) {" << endl;
+  tt << "          const size_t size = r->get_size_alloc(b);" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> data = s->get_block(b);" << endl;
+  tt << "          for (size_t i = 0; i != size; ++i)" << endl;
+  tt << "            data[i] *= a;" << endl;
+  tt << "          r->put_block(data, b);" << endl;
+  tt << "        }" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // r += a*s, returning the rms of the result" << endl;
+  tt << "    static double add_rms(std::shared_ptr<Tensor> r, std::shared_ptr<const Tensor> s, const double a) {" << endl;
+  tt << "      double sum = 0.0;" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(r->indexrange()))" << endl;
+  tt << "        if (r->get_size_alloc(b) && r->is_local(b)) {" << endl;
+  tt << "          const size_t size = r->get_size_alloc(b);" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> data = r->get_block(b);" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> sdata = s->get_block(b);" << endl;
+  tt << "          for (size_t i = 0; i != size; ++i) {" << endl;
+  tt << "            data[i] += a * sdata[i];" << endl;
+  tt << "            sum += std::norm(data[i]);" << endl;
+  tt << "          }" << endl;
+  tt << "          r->put_block(data, b);" << endl;
+  tt << "        }" << endl;
+  tt << "      mpi__->allreduce(&sum, 1);" << endl;
+  tt << "      return std::sqrt(sum / r->size_alloc());" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_queue_replay() const {
+  stringstream tt;
+  tt << "// Queues that are built once and run in every iteration. The first run computes the tasks through Queue::next_compute and records" << endl;
+  tt << "// the order in which they became ready; later runs zero the intermediates of the queue and compute the same task objects in that" << endl;
+  tt << "// order, so that the tasks, their subtask lists and the allocated intermediates are kept between iterations." << endl;
+  tt << "class QueueReplay {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    struct Entry {" << endl;
+  tt << "      std::vector<std::weak_ptr<Tensor>> intermediates;" << endl;
+  tt << "      std::vector<std::shared_ptr<Task>> order;" << endl;
+  tt << "    };" << endl;
+  tt << "    // every make_*q registers its intermediates; entries of queues that were not kept are dropped once the queue is gone" << endl;
+  tt << "    std::map<std::weak_ptr<Queue>, Entry, std::owner_less<std::weak_ptr<Queue>>> entry_;" << endl << endl;
+  tt << "    QueueReplay() { }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static QueueReplay& get() { static QueueReplay q; return q; }" << endl << endl;
+  tt << "    void add_intermediate(const std::shared_ptr<Queue>& q, std::shared_ptr<Tensor> t) {" << endl;
+  tt << "      // intermediates of diagonal-only terms are not constructed unless diagonal is set" << endl;
+  tt << "      if (!t) return;" << endl;
+  tt << "      if (!entry_.count(q))" << endl;
+  tt << "        for (auto i = entry_.begin(); i != entry_.end(); )" << endl;
+  tt << "          i = i->first.expired() ? entry_.erase(i) : ++i;" << endl;
+  tt << "      entry_[q].intermediates.push_back(t);" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    void run(const std::shared_ptr<Queue>& q) {" << endl;
+  tt << "      Entry& e = entry_[q];" << endl;
+  tt << "      if (e.order.empty()) {" << endl;
+  tt << "        while (!q->done())" << endl;
+  tt << "          e.order.push_back(q->next_compute());" << endl;
+  tt << "        return;" << endl;
+  tt << "      }" << endl;
+  tt << "      // released intermediates (see release_intermediates) are allocated again by their first task" << endl;
+  tt << "      for (auto& i : e.intermediates) {" << endl;
+  tt << "        std::shared_ptr<Tensor> t = i.lock();" << endl;
+  tt << "        if (t && t->allocated()) t->zero();" << endl;
+  tt << "      }" << endl;
+  tt << "      for (auto& i : e.order)" << endl;
+  tt << "        i->compute();" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // releases the tasks of q" << endl;
+  tt << "    void erase(const std::shared_ptr<Queue>& q) { entry_.erase(q); }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_cost_descriptor() const {
+  stringstream tt;
+  const int n = IndexMap().size();
+  tt << "// Predicted cost of a task, returned by TaskN::cost(). Polynomials are lists of {coefficient, {{exponents}}} in the sizes of" << endl;
+  tt << "// closed, active and virtual orbitals" << (df_integrals ? ", ci determinants and auxiliary functions" : " and ci determinants") << ". Depth is that in the tree (-1 for Gamma tasks)." << endl;
+  tt << "struct TaskCost {" << endl;
+  tt << "  using Polynomial = std::vector<std::pair<double, std::array<int," << n << ">>>;" << endl;
+  tt << "  int depth;" << endl;
+  tt << "  Polynomial flops;" << endl;
+  tt << "  Polynomial out;" << endl;
+  tt << "  std::vector<Polynomial> in;" << endl << endl;
+  tt << "  static double evaluate(const Polynomial& p, const std::array<size_t," << n << ">& size) {" << endl;
+  tt << "    double out = 0.0;" << endl;
+  tt << "    for (auto& i : p) {" << endl;
+  tt << "      double term = i.first;" << endl;
+  tt << "      for (int j = 0; j != " << n << "; ++j)" << endl;
+  tt << "        term *= std::pow(static_cast<double>(size[j]), i.second[j]);" << endl;
+  tt << "      out += term;" << endl;
+  tt << "    }" << endl;
+  tt << "    return out;" << endl;
+  tt << "  }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
+string Forest::generate_gamma_cache() const {
+  stringstream tt;
+  tt << "// On-disk cache of Gamma tensors, enabled when BAGEL_GAMMA_CACHE names a directory. Each Gamma is keyed by a hash of" << endl;
+  tt << "// its generated code and of its input tensors on all processes, and stored per MPI process as a memory-mapped file." << endl;
+  tt << "// key() and load() are collective, so that all processes agree on the key and either all load an entry or none does." << endl;
+  tt << "class GammaCache {" << endl;
+  tt << "  protected:" << endl;
+  tt << "    std::string dir_;" << endl << endl;
+  tt << "    GammaCache() { const char* d = std::getenv(\"BAGEL_GAMMA_CACHE\"); if (d) dir_ = d; }" << endl << endl;
+  tt << "    static uint64_t fnv(const void* data, const size_t n, uint64_t h = 14695981039346656037ull) {" << endl;
+  tt << "      const unsigned char* p = static_cast<const unsigned char*>(data);" << endl;
+  tt << "      for (size_t i = 0; i != n; ++i) { h ^= p[i]; h *= 1099511628211ull; }" << endl;
+  tt << "      return h;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // hashed on every call, as set_rdm replaces the rdms (and their addresses may be reused); cheap next to the Gamma contraction" << endl;
+  tt << "    static uint64_t hash(const std::shared_ptr<const Tensor>& t) {" << endl;
+  tt << "      uint64_t h = fnv(nullptr, 0);" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(t->indexrange()))" << endl;
+  tt << "        if (t->is_local(b)) {" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> data = t->get_block(b);" << endl;
+  tt << "          h = fnv(data.get(), t->get_size(b)*sizeof(" << DataType << "), h);" << endl;
+  tt << "        }" << endl;
+  tt << "      return h;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    std::string file(const std::string& label, const uint64_t key) const {" << endl;
+  tt << "      std::stringstream ss;" << endl;
+  tt << "      ss << dir_ << \"/\" << label << \"_\" << std::hex << key << std::dec << \"_\" << mpi__->rank() << \".bin\";" << endl;
+  tt << "      return ss.str();" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // total number of elements in the local blocks of out" << endl;
+  tt << "    static size_t local_size(const std::shared_ptr<Tensor>& out) {" << endl;
+  tt << "      size_t size = 0;" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(out->indexrange()))" << endl;
+  tt << "        if (out->is_local(b)) size += out->get_size(b);" << endl;
+  tt << "      return size;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "  public:" << endl;
+  tt << "    static GammaCache& get() { static GammaCache c; return c; }" << endl << endl;
+  tt << "    bool enabled() const { return !dir_.empty(); }" << endl << endl;
+  tt << "    template<size_t N>" << endl;
+  tt << "    uint64_t key(const uint64_t code, const std::array<std::shared_ptr<const Tensor>,N>& in) const {" << endl;
+  tt << "      if (!enabled()) return 0;" << endl;
+  tt << "      uint64_t local = fnv(nullptr, 0);" << endl;
+  tt << "      for (auto& i : in) {" << endl;
+  tt << "        const uint64_t t = hash(i);" << endl;
+  tt << "        local = fnv(&t, sizeof(uint64_t), local);" << endl;
+  tt << "      }" << endl;
+  tt << "      // the hashes of all processes, in 32-bit halves that are exact in double" << endl;
+  tt << "      std::vector<double> all(2*mpi__->size(), 0.0);" << endl;
+  tt << "      all[2*mpi__->rank()] = static_cast<double>(local >> 32);" << endl;
+  tt << "      all[2*mpi__->rank()+1] = static_cast<double>(local & 0xffffffffull);" << endl;
+  tt << "      mpi__->allreduce(all.data(), all.size());" << endl;
+  tt << "      uint64_t h = code;" << endl;
+  tt << "      for (auto& i : all) {" << endl;
+  tt << "        const uint64_t t = static_cast<uint64_t>(i);" << endl;
+  tt << "        h = fnv(&t, sizeof(uint64_t), h);" << endl;
+  tt << "      }" << endl;
+  tt << "      return h;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    // fills the local blocks of out from the cache; returns false, on all processes, unless every process has a matching entry" << endl;
+  tt << "    bool load(const std::string& label, const uint64_t key, std::shared_ptr<Tensor> out) const {" << endl;
+  tt << "      if (!enabled()) return false;" << endl;
+  tt << "      // processes without local blocks store no file" << endl;
+  tt << "      const size_t bytes = local_size(out)*sizeof(" << DataType << ");" << endl;
+  tt << "      void* map = MAP_FAILED;" << endl;
+  tt << "      if (bytes != 0) {" << endl;
+  tt << "        const int fd = open(file(label, key).c_str(), O_RDONLY);" << endl;
+  tt << "        if (fd >= 0) {" << endl;
+  tt << "          if (lseek(fd, 0, SEEK_END) == static_cast<off_t>(bytes))" << endl;
+  tt << "            map = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0);" << endl;
+  tt << "          close(fd);" << endl;
+  tt << "        }" << endl;
+  tt << "      }" << endl;
+  tt << "      double miss = bytes != 0 && map == MAP_FAILED ? 1.0 : 0.0;" << endl;
+  tt << "      mpi__->allreduce(&miss, 1);" << endl;
+  tt << "      if (miss != 0.0) {" << endl;
+  tt << "        if (map != MAP_FAILED) munmap(map, bytes);" << endl;
+  tt << "        return false;" << endl;
+  tt << "      }" << endl;
+  tt << "      if (bytes == 0) return true;" << endl;
+  tt << "      const " << DataType << "* data = static_cast<const " << DataType << "*>(map);" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(out->indexrange()))" << endl;
+  tt << "        if (out->is_local(b)) {" << endl;
+  tt << "          const size_t size = out->get_size(b);" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> buf(new " << DataType << "[size]);" << endl;
+  tt << "          std::copy_n(data, size, buf.get());" << endl;
+  tt << "          out->put_block(buf, b);" << endl;
+  tt << "          data += size;" << endl;
+  tt << "        }" << endl;
+  tt << "      munmap(map, bytes);" << endl;
+  tt << "      return true;" << endl;
+  tt << "    }" << endl << endl;
+  tt << "    void store(const std::string& label, const uint64_t key, std::shared_ptr<const Tensor> out) const {" << endl;
+  tt << "      if (!enabled()) return;" << endl;
+  tt << "      const size_t bytes = local_size(std::const_pointer_cast<Tensor>(out))*sizeof(" << DataType << ");" << endl;
+  tt << "      if (bytes == 0) return;" << endl;
+  tt << "      const std::string name = file(label, key);" << endl;
+  tt << "      const std::string tmp = name + \".tmp\";" << endl;
+  tt << "      const int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);" << endl;
+  tt << "      if (fd < 0) return;" << endl;
+  tt << "      void* map = ftruncate(fd, bytes) == 0 ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;" << endl;
+  tt << "      close(fd);" << endl;
+  tt << "      if (map == MAP_FAILED) {" << endl;
+  tt << "        unlink(tmp.c_str());" << endl;
+  tt << "        return;" << endl;
+  tt << "      }" << endl;
+  tt << "      " << DataType << "* data = static_cast<" << DataType << "*>(map);" << endl;
+  tt << "      for (auto& b : LoopGenerator::gen(out->indexrange()))" << endl;
+  tt << "        if (out->is_local(b)) {" << endl;
+  tt << "          std::unique_ptr<" << DataType << "[]> buf = out->get_block(b);" << endl;
+  tt << "          const size_t size = out->get_size(b);" << endl;
+  tt << "          std::copy_n(buf.get(), size, data);" << endl;
+  tt << "          data += size;" << endl;
+  tt << "        }" << endl;
+  tt << "      msync(map, bytes, MS_SYNC);" << endl;
+  tt << "      munmap(map, bytes);" << endl;
+  tt << "      // readers never see a partially written entry" << endl;
+  tt << "      rename(tmp.c_str(), name.c_str());" << endl;
+  tt << "    }" << endl;
+  tt << "};" << endl << endl;
+  return tt.str();
+}
+
+
 OutStream Forest::generate_gammas() const {
   OutStream out;
   string indent = "      ";
@@ -219,7 +1212,7 @@ OutStream Forest::generate_gammas() const {
       out.gg << "  array<shared_ptr<const IndexRange>,4> cindex = {{rclosed_, ractive_, rvirt_, rci_}};" << endl;
 
     // switch for blas, if true merged rdm*f1 tensor multiplication will use blas
-    bool use_blas = false;
+    const bool use_blas = gamma_blas;
     out << i->generate_gamma(icnt, use_blas, i->der());
 
     vector<string> tmp = {i->label()};
@@ -262,6 +1255,67 @@ OutStream Forest::generate_gammas() const {
 }
 
 
+OutStream Forest::generate_peak_memory(shared_ptr<Tree> tree) const {
+  OutStream out;
+  map<string, MCost> live;
+  vector<MCost> peaks;
+  tree->simulate_memory(live, peaks);
+
+  // only those that can be the maximum for some sizes of orbital spaces
+  vector<MCost> candidates;
+  for (auto i = peaks.begin(); i != peaks.end(); ++i) {
+    bool bounded = false;
+    for (auto j = peaks.begin(); j != peaks.end() && !bounded; ++j)
+      bounded = i != j && i->bounded_by(*j) && (!j->bounded_by(*i) || j < i);
+    if (!bounded) candidates.push_back(*i);
+  }
+
+  out.ss << "    size_t peak_memory_" << tree->label() << "q() const;" << endl;
+
+  out.ee << "size_t " << forest_name_ << "::" << forest_name_ << "::peak_memory_" << tree->label() << "q() const {" << endl;
+  out.ee << "  // number of elements of intermediates (over all processes) that are alive at the same time when " << tree->label() << "q is run in order" << endl;
+  if (candidates.empty()) {
+    out.ee << "  return 0;" << endl;
+  } else {
+    IndexMap indmap;
+    string sizes;
+    for (auto& i : indmap)
+      sizes += (sizes.empty() ? "" : ", ") + i.first + "=" + to_string(i.second.second);
+    out.ee << "  // peak for " << sizes << ": " << max_element(candidates.begin(), candidates.end())->show() << endl;
+    if (candidates.size() == 1) {
+      out.ee << "  return " << candidates.front().generate() << ";" << endl;
+    } else {
+      out.ee << "  return max({" << endl;
+      for (auto i = candidates.begin(); i != candidates.end(); ++i)
+        out.ee << "    " << i->generate() << (i+1 != candidates.end() ? "," : "") << endl;
+      out.ee << "  });" << endl;
+    }
+  }
+  out.ee << "}" << endl << endl;
+  return out;
+}
+
+
+OutStream Forest::generate_gamma_memory(shared_ptr<Tree> tree) const {
+  OutStream out;
+  // every use of a Gamma in the queue constructs its own tensor, which lives as long as the task that reads it
+  MCost total;
+  for (auto& i : tree->gather_gamma()) {
+    list<string> labels;
+    for (auto& j : i->index()) labels.push_back(j->label());
+    total += MCost(labels);
+  }
+
+  out.ss << "    size_t gamma_memory_" << tree->label() << "q() const;" << endl;
+
+  out.ee << "size_t " << forest_name_ << "::" << forest_name_ << "::gamma_memory_" << tree->label() << "q() const {" << endl;
+  out.ee << "  // number of elements of the Gamma tensors constructed by " << tree->label() << "q (on all processes)" << endl;
+  out.ee << "  return " << (total.empty() ? "0" : total.generate()) << ";" << endl;
+  out.ee << "}" << endl << endl;
+  return out;
+}
+
+
 OutStream Forest::generate_algorithm() const {
   OutStream out;
   string indent = "      ";
@@ -280,6 +1334,9 @@ OutStream Forest::generate_algorithm() const {
     out.ee << "  for (int i = 0; i != eig.size(); ++i)" << endl;
     out.ee << "    eig_[i] = real(eig[i]);" << endl;
   }
+  // f1_ of a new reference may share its address with a previous one
+  if (diagonal_fock)
+    out.ee << "  FockDiagonal::get().clear();" << endl;
   if (forest_name_ == "MRCI" || forest_name_ == "RelMRCI") {
     out.ee << "  nstates_ = ref->ciwfn()->nstates();" << endl << endl;
 
@@ -314,6 +1371,11 @@ OutStream Forest::generate_algorithm() const {
     out.ee << caspt2_main_driver_();
   else if (forest_name_ == "MRCI" || forest_name_ == "RelMRCI")
     out.ee << msmrci_main_driver_();
+  if (profile_tasks) {
+    out.ee << endl;
+    out.ee << "  TaskProfile::get().report();" << endl;
+    out.ee << "  TaskProfile::get().write_trace(\"" << forest_name_ << "_trace\");" << endl;
+  }
 
   out.ee << "}" << endl;
   out.ee << endl;
@@ -404,25 +1466,70 @@ string Forest::caspt2_main_driver_() {
   ss << "    sourceq->next_compute();" << endl;
 
   ss << "  Timer mtimer;" << endl;
+  if (mixed_precision)
+    ss << "  MixedPrecision::get().set_single(true);" << endl;
+  // the tasks of the residual queue refer to r and t2, whose addresses do not change during the iterations
+  if (reuse_queues)
+    ss << "  shared_ptr<Queue> residualq = make_residualq(" << (fuse_update ? "false" : "") << ");" << endl;
   ss << "  int iter = 0;" << endl;
   ss << "  for ( ; iter != info_->maxiter(); ++iter) {" << endl;
-  ss << "    energy_ = detail::real(dot_product_transpose(s, t2));" << endl;
-
-  ss << "    shared_ptr<Queue> queue = make_residualq();" << endl;
-  ss << "    while (!queue->done())" << endl;
-  ss << "      queue->next_compute();" << endl;
-  ss << "    diagonal(r, t2);" << endl;
-  ss << "    r->ax_plus_y(1.0, s);" << endl;
+  if (fuse_update) {
+    // the residual tasks accumulate on top of 2s instead of zero
+    ss << "    ResidualUpdate::seed(r, s, 2.0);" << endl;
+    if (reuse_queues) {
+      if (screen_blocks)
+        ss << "    BlockNorms::get().clear();" << endl;
+      if (four_external)
+        ss << "    FourExternal::clear();" << endl;
+      ss << "    QueueReplay::get().run(residualq);" << endl;
+    } else {
+      ss << "    shared_ptr<Queue> queue = make_residualq(false);" << endl;
+      ss << "    while (!queue->done())" << endl;
+      ss << "      queue->next_compute();" << endl;
+    }
+    ss << "    diagonal(r, t2);" << endl;
+    ss << "    energy_ = detail::real(dot_product_transpose(r, t2));" << endl;
+    ss << "    const double err = ResidualUpdate::add_rms(r, s, -1.0);" << endl;
+  } else {
+    ss << "    energy_ = detail::real(dot_product_transpose(s, t2));" << endl;
+
+    if (reuse_queues) {
+      if (screen_blocks)
+        ss << "    BlockNorms::get().clear();" << endl;
+      if (four_external)
+        ss << "    FourExternal::clear();" << endl;
+      ss << "    QueueReplay::get().run(residualq);" << endl;
+    } else {
+      ss << "    shared_ptr<Queue> queue = make_residualq();" << endl;
+      ss << "    while (!queue->done())" << endl;
+      ss << "      queue->next_compute();" << endl;
+    }
+    ss << "    diagonal(r, t2);" << endl;
+    ss << "    r->ax_plus_y(1.0, s);" << endl;
 
-  ss << "    energy_ += detail::real(dot_product_transpose(r, t2));" << endl;
+    ss << "    energy_ += detail::real(dot_product_transpose(r, t2));" << endl;
 
-  ss << "    const double err = r->rms();" << endl;
+    ss << "    const double err = r->rms();" << endl;
+  }
   ss << "    print_iteration(iter, energy_, err, mtimer.tick());" << endl;
   ss << endl;
+  if (mixed_precision) {
+    // residuals from FP32 contractions do not count towards convergence; the switch is made no later than at convergence
+    ss << "    const bool single = MixedPrecision::get().single();" << endl;
+    ss << "    if (single && err < max(MixedPrecision::get().thresh(), info_->thresh()))" << endl;
+    ss << "      MixedPrecision::get().set_single(false);" << endl;
+  }
   ss << "    update_amplitude(t2, r);" << endl;
-  ss << "    r->zero();" << endl;
-  ss << "    if (err < info_->thresh()) break;" << endl;
+  if (!fuse_update)
+    ss << "    r->zero();" << endl;
+  ss << "    if (err < info_->thresh()" << (mixed_precision ? " && !single" : "") << ") break;" << endl;
   ss << "  }" << endl;
+  if (fuse_update)
+    ss << "  r->zero();" << endl;
+  if (reuse_queues)
+    ss << "  QueueReplay::get().erase(residualq);" << endl;
+  if (mixed_precision)
+    ss << "  MixedPrecision::get().set_single(false);" << endl;
   ss << "  print_iteration(iter == info_->maxiter());" << endl;
   ss << "  timer.tick_print(\"CASPT2 energy evaluation\");" << endl;
 
@@ -437,7 +1544,31 @@ string Forest::msmrci_main_driver_() {
 
   ss << "  const double core_nuc = core_energy_ + info_->geom()->nuclear_repulsion();" << endl << endl;
 
+  if (state_batch) {
+    // without release_intermediates, the intermediates of all state pairs in a queue are alive until it is run
+    ss << "  // the intermediates and Gammas of the state pairs in a batch are alive at the same time; a batch is run before it exceeds" << endl;
+    ss << "  // BAGEL_SMITH_MEMORY (GB), or once it has " << state_batch_max << " pairs if no budget is given" << endl;
+    ss << "  const char* budget = getenv(\"BAGEL_SMITH_MEMORY\");" << endl;
+    ss << "  const double memory = budget ? atof(budget) * 1.0e9 / sizeof(" << DataType << ") : 0.0;" << endl;
+    ss << "  auto batch = [&memory](shared_ptr<Queue>& queue, double& used, int& pairs, const size_t peak) {" << endl;
+    ss << "    if (pairs > 0 && (memory > 0.0 ? used + peak > memory : pairs == " << state_batch_max << ")) {" << endl;
+    ss << "      while (!queue->done())" << endl;
+    ss << "        queue->next_compute();" << endl;
+    ss << "      queue = make_shared<Queue>();" << endl;
+    ss << "      used = 0.0;" << endl;
+    ss << "      pairs = 0;" << endl;
+    ss << "    }" << endl;
+    ss << "    used += peak;" << endl;
+    ss << "    ++pairs;" << endl;
+    ss << "  };" << endl << endl;
+  }
+
   ss << "  // target state" << endl;
+  if (state_batch) {
+    ss << "  auto sourceq = make_shared<Queue>();" << endl;
+    ss << "  double sourcemem = 0.0;" << endl;
+    ss << "  int sourcepairs = 0;" << endl;
+  }
   ss << "  for (int istate = 0; istate != nstates_; ++istate) {" << endl;
   ss << "    const double refen = info_->ciwfn()->energy(istate) - core_nuc;" << endl;
   ss << "    // takes care of ref coefficients" << endl;
@@ -448,13 +1579,28 @@ string Forest::msmrci_main_driver_() {
   ss << "    for (int jst = 0; jst != nstates_; ++jst) {" << endl;
   ss << "      set_rdm(jst, istate);" << endl;
   ss << "      s = sall_[istate]->at(jst);" << endl;
-  ss << "      auto queue = make_sourceq(false, jst == istate);" << endl;
-  ss << "      while (!queue->done())" << endl;
-  ss << "        queue->next_compute();" << endl;
+  if (state_batch) {
+    ss << "      batch(sourceq, sourcemem, sourcepairs, peak_memory_sourceq() + gamma_memory_sourceq());" << endl;
+    ss << "      make_sourceq(false, jst == istate, sourceq);" << endl;
+  } else {
+    ss << "      auto queue = make_sourceq(false, jst == istate);" << endl;
+    ss << "      while (!queue->done())" << endl;
+    ss << "        queue->next_compute();" << endl;
+  }
   ss << "    }" << endl;
-  ss << "  }" << endl << endl;
+  ss << "  }" << endl;
+  if (state_batch) {
+    ss << "  while (!sourceq->done())" << endl;
+    ss << "    sourceq->next_compute();" << endl;
+  }
+  ss << endl;
 
-  ss << "  DavidsonDiag_<Amplitude<" << DataType << ">, Residual<" << DataType << ">, " << MatType << "> davidson(nstates_, 10);" << endl << endl;
+  if (mixed_precision) {
+    // held by pointer so that the subspace can be restarted at the switch to double precision
+    ss << "  auto davidson = make_shared<DavidsonDiag_<Amplitude<" << DataType << ">, Residual<" << DataType << ">, " << MatType << ">>(nstates_, 10);" << endl << endl;
+  } else {
+    ss << "  DavidsonDiag_<Amplitude<" << DataType << ">, Residual<" << DataType << ">, " << MatType << "> davidson(nstates_, 10);" << endl << endl;
+  }
 
   ss << "  // first iteration is trivial" << endl;
   ss << "  {" << endl;
@@ -464,14 +1610,14 @@ string Forest::msmrci_main_driver_() {
   ss << "      a0.push_back(make_shared<Amplitude<" << DataType << ">>(t2all_[istate]->copy(), nall_[istate]->copy(), this));" << endl;
   ss << "      r0.push_back(make_shared<Residual<" << DataType << ">>(sall_[istate]->copy(), this));" << endl;
   ss << "    }" << endl;
-  ss << "    energy_ = davidson.compute(a0, r0);" << endl;
+  ss << "    energy_ = davidson" << (mixed_precision ? "->" : ".") << "compute(a0, r0);" << endl;
   ss << "    for (int istate = 0; istate != nstates_; ++istate)" << endl;
   ss << "      assert(fabs(energy_[istate]+core_nuc - info_->ciwfn()->energy(istate)) < 1.0e-8);" << endl;
   ss << "  }" << endl << endl;
 
   ss << "  // set the result to t2" << endl;
   ss << "  {" << endl;
-  ss << "    vector<shared_ptr<Residual<" << DataType << ">>> res = davidson.residual();" << endl;
+  ss << "    vector<shared_ptr<Residual<" << DataType << ">>> res = davidson" << (mixed_precision ? "->" : ".") << "residual();" << endl;
   ss << "    for (int i = 0; i != nstates_; ++i) {" << endl;
   ss << "      t2all_[i]->zero();" << endl;
   ss << "      update_amplitude(t2all_[i], res[i]->tensor());" << endl;
@@ -484,6 +1630,10 @@ string Forest::msmrci_main_driver_() {
   ss << "  Timer mtimer;" << endl;
   ss << "  int iter = 0;" << endl;
   ss << "  vector<bool> conv(nstates_, false);" << endl;
+  if (mixed_precision) {
+    ss << "  MixedPrecision::get().set_single(true);" << endl;
+    ss << "  bool restart = false;" << endl;
+  }
   ss << "  for ( ; iter != info_->maxiter(); ++iter) {" << endl << endl;
 
   ss << "    // loop over state of interest" << endl;
@@ -497,16 +1647,36 @@ string Forest::msmrci_main_driver_() {
   ss << "      }" << endl;
   ss << "      // first calculate left-hand-side vectors of t2 (named n)" << endl;
   ss << "      nall_[istate]->zero();" << endl;
+  if (state_batch) {
+    ss << "      auto normq = make_shared<Queue>();" << endl;
+    ss << "      double normmem = 0.0;" << endl;
+    ss << "      int normpairs = 0;" << endl;
+  }
   ss << "      for (int ist = 0; ist != nstates_; ++ist) {" << endl;
   ss << "        for (int jst = 0; jst != nstates_; ++jst) {" << endl;
   ss << "          set_rdm(jst, ist);" << endl;
   ss << "          t2 = t2all_[istate]->at(ist);" << endl;
   ss << "          n  = nall_[istate]->at(jst);" << endl;
-  ss << "          auto queue = make_normq(false, jst == ist);" << endl;
-  ss << "          while (!queue->done())" << endl;
-  ss << "            queue->next_compute();" << endl;
+  if (state_batch) {
+    ss << "          batch(normq, normmem, normpairs, peak_memory_normq() + gamma_memory_normq());" << endl;
+    ss << "          make_normq(false, jst == ist, normq);" << endl;
+  } else {
+    ss << "          auto queue = make_normq(false, jst == ist);" << endl;
+    ss << "          while (!queue->done())" << endl;
+    ss << "            queue->next_compute();" << endl;
+  }
   ss << "        }" << endl;
-  ss << "      }" << endl << endl;
+  ss << "      }" << endl;
+  if (state_batch) {
+    ss << "      while (!normq->done())" << endl;
+    ss << "        normq->next_compute();" << endl;
+  }
+  if (mixed_precision) {
+    ss << "      if (restart)" << endl;
+    ss << "        for (int ist = 0; ist != nstates_; ++ist)" << endl;
+    ss << "          nall_[istate]->fac(ist) = t2all_[istate]->fac(ist);" << endl;
+  }
+  ss << endl;
 
   ss << "      // normalize t2 and n" << endl;
   ss << "      const double scal = 1.0 / sqrt(detail::real(dot_product_transpose(nall_[istate], t2all_[istate])));" << endl;
@@ -517,14 +1687,24 @@ string Forest::msmrci_main_driver_() {
 
   ss << "      // compute residuals (named r)" << endl;
   ss << "      rtmp->zero();" << endl;
+  if (state_batch) {
+    ss << "      auto residualq = make_shared<Queue>();" << endl;
+    ss << "      double residualmem = 0.0;" << endl;
+    ss << "      int residualpairs = 0;" << endl;
+  }
   ss << "      for (int ist = 0; ist != nstates_; ++ist) { // ket sector" << endl;
   ss << "        for (int jst = 0; jst != nstates_; ++jst) { // bra sector" << endl;
   ss << "          set_rdm(jst, ist);" << endl;
   ss << "          t2 = t2all_[istate]->at(ist);" << endl;
   ss << "          r = rtmp->at(jst);" << endl;
-  ss << "          auto queue = make_residualq(false, jst == ist);" << endl;
-  ss << "          while (!queue->done())" << endl;
-  ss << "            queue->next_compute();" << endl;
+  if (state_batch) {
+    ss << "          batch(residualq, residualmem, residualpairs, peak_memory_residualq() + gamma_memory_residualq());" << endl;
+    ss << "          make_residualq(false, jst == ist, residualq);" << endl;
+  } else {
+    ss << "          auto queue = make_residualq(false, jst == ist);" << endl;
+    ss << "          while (!queue->done())" << endl;
+    ss << "            queue->next_compute();" << endl;
+  }
   ss << "          diagonal(r, t2);" << endl;
   ss << "        }" << endl;
   ss << "      }" << endl << endl;
@@ -540,38 +1720,82 @@ string Forest::msmrci_main_driver_() {
   ss << "            set_rdm(jst, ist);" << endl;
   ss << "            t2 = m->at(ist);" << endl;
   ss << "            n  = rtmp->at(jst);" << endl;
-  ss << "            auto queue = make_normq(false, jst == ist);" << endl;
-  ss << "            while (!queue->done())" << endl;
-  ss << "              queue->next_compute();" << endl;
+  if (state_batch) {
+    // accumulates into rtmp as the residual tasks do, so it joins the same queue
+    ss << "            batch(residualq, residualmem, residualpairs, peak_memory_normq() + gamma_memory_normq());" << endl;
+    ss << "            make_normq(false, jst == ist, residualq);" << endl;
+  } else {
+    ss << "            auto queue = make_normq(false, jst == ist);" << endl;
+    ss << "            while (!queue->done())" << endl;
+    ss << "              queue->next_compute();" << endl;
+  }
   ss << "          }" << endl;
   ss << "        }" << endl;
+  if (state_batch) {
+    ss << "        // all state couplings in one pass" << endl;
+    ss << "        while (!residualq->done())" << endl;
+    ss << "          residualq->next_compute();" << endl;
+  }
   ss << "      }" << endl << endl;
 
   ss << "      {" << endl;
   ss << "        shared_ptr<MultiTensor> m = rtmp->copy();" << endl;
   ss << "        for (int ist = 0; ist != nstates_; ++ist)" << endl;
   ss << "          m->fac(ist) = dot_product_transpose(sall_[ist], t2all_[istate]);" << endl;
+  if (mixed_precision) {
+    // restarted trial vectors carry reference coefficients, whose sigma vectors are sall_
+    ss << "        if (restart)" << endl;
+    ss << "          for (int ist = 0; ist != nstates_; ++ist)" << endl;
+    ss << "            m->ax_plus_y(t2all_[istate]->fac(ist), sall_[ist]);" << endl;
+  }
   ss << "        r0.push_back(make_shared<Residual<" << DataType << ">>(m, this));" << endl;
   ss << "      }" << endl;
   ss << "    }" << endl << endl;
 
-  ss << "    energy_ = davidson.compute(a0, r0);" << endl << endl;
+  ss << "    energy_ = davidson" << (mixed_precision ? "->" : ".") << "compute(a0, r0);" << endl << endl;
+  if (mixed_precision)
+    ss << "    restart = false;" << endl << endl;
 
   ss << "    // find new trial vectors" << endl;
-  ss << "    vector<shared_ptr<Residual<" << DataType << ">>> res = davidson.residual();" << endl;
+  ss << "    vector<shared_ptr<Residual<" << DataType << ">>> res = davidson" << (mixed_precision ? "->" : ".") << "residual();" << endl;
+  if (mixed_precision) {
+    ss << "    const bool single = MixedPrecision::get().single();" << endl;
+    ss << "    double maxerr = 0.0;" << endl;
+  }
   ss << "    for (int i = 0; i != nstates_; ++i) {" << endl;
   ss << "      const double err = res[i]->tensor()->rms();" << endl;
   ss << "      print_iteration(iter, energy_[i]+core_nuc, err, mtimer.tick(), i);" << endl << endl;
 
   ss << "      t2all_[i]->zero();" << endl;
-  ss << "      conv[i] = err < info_->thresh();" << endl;
+  if (mixed_precision) {
+    ss << "      if (!conv[i]) maxerr = max(maxerr, err);" << endl;
+    ss << "      conv[i] = err < info_->thresh() && !single;" << endl;
+  } else {
+    ss << "      conv[i] = err < info_->thresh();" << endl;
+  }
   ss << "      if (!conv[i])" << endl;
   ss << "        update_amplitude(t2all_[i], res[i]->tensor());" << endl;
   ss << "    }" << endl;
   ss << "    if (nstates_ > 1) cout << endl;" << endl << endl;
+  if (mixed_precision) {
+    // the subspace holds sigma vectors computed in single precision; it is restarted from the current
+    // solutions so that every sigma vector entering the converged energies is computed in double precision
+    ss << "    if (single && maxerr < max(MixedPrecision::get().thresh(), info_->thresh()) && iter+1 != info_->maxiter()) {" << endl;
+    ss << "      MixedPrecision::get().set_single(false);" << endl;
+    ss << "      vector<shared_ptr<Amplitude<" << DataType << ">>> ci = davidson->civec();" << endl;
+    ss << "      for (int i = 0; i != nstates_; ++i) {" << endl;
+    ss << "        t2all_[i] = ci[i]->tensor()->copy();" << endl;
+    ss << "        conv[i] = false;" << endl;
+    ss << "      }" << endl;
+    ss << "      davidson = make_shared<DavidsonDiag_<Amplitude<" << DataType << ">, Residual<" << DataType << ">, " << MatType << ">>(nstates_, 10);" << endl;
+    ss << "      restart = true;" << endl;
+    ss << "    }" << endl << endl;
+  }
 
   ss << "    if (all_of(conv.begin(), conv.end(), [](bool i){ return i;})) break;" << endl;
   ss << "  }" << endl;
+  if (mixed_precision)
+    ss << "  MixedPrecision::get().set_single(false);" << endl;
   ss << "  print_iteration(iter == info_->maxiter());" << endl;
   ss << "  timer.tick_print(\"MRCI energy evaluation\");" << endl << endl;
 
@@ -579,7 +1803,7 @@ string Forest::msmrci_main_driver_() {
   ss << "  {" << endl;
   ss << "    cout << endl;" << endl;
   ss << "    vector<double> energy_q(nstates_);" << endl;
-  ss << "    vector<shared_ptr<Amplitude<" << DataType << ">>> ci = davidson.civec();" << endl;
+  ss << "    vector<shared_ptr<Amplitude<" << DataType << ">>> ci = davidson" << (mixed_precision ? "->" : ".") << "civec();" << endl;
   ss << "    for (int i = 0; i != nstates_; ++i) {" << endl;
   ss << "      const double c = norm(ci[i]->tensor()->fac(i));" << endl;
   ss << "      const double eref = info_->ciwfn()->energy(i);" << endl;
@@ -78,6 +78,37 @@ class Forest {
     OutStream generate_code() const;
     /// Generates headers and residual target task.
     OutStream generate_headers() const;
+    /// Generates the thread-local scratch-buffer pool used by generated tasks.
+    std::string generate_scratch_pool() const;
+    /// Generates the persistent background thread that retrieves blocks for the prefetching inner loops.
+    std::string generate_block_fetcher() const;
+    /// Generates the cache of block norms used for screening in generated tasks.
+    std::string generate_block_norms() const;
+    /// Generates the on-disk Gamma cache used by generated Gamma tasks.
+    std::string generate_gamma_cache() const;
+    /// Generates a function that returns the estimated peak memory of intermediates in the queue of a tree.
+    OutStream generate_peak_memory(std::shared_ptr<Tree> tree) const;
+    OutStream generate_gamma_memory(std::shared_ptr<Tree> tree) const;
+    /// Generates the per-task timing, flop and byte counters used by generated tasks.
+    std::string generate_task_profile() const;
+    /// Generates the cost-weighted assignment of subtasks to processes used by generated task constructors.
+    std::string generate_subtask_balancer() const;
+    /// Generates the run-time check that f1 is diagonal, used by the elementwise Fock kernels.
+    std::string generate_fock_diagonal() const;
+    /// Generates the single-precision contraction kernel and its switch used by the drivers.
+    std::string generate_mixed_precision() const;
+    /// Generates the compile-time sized kernels for contractions of all-active blocks.
+    std::string generate_active_kernel() const;
+    /// Generates the thread-private accumulation of output blocks used by residual tasks.
+    std::string generate_block_accumulator() const;
+    /// Generates the formation of 4-external integral blocks from the DF integrals.
+    std::string generate_four_external() const;
+    /// Generates the fused seeding and update sweeps over the residual used by the CASPT2 driver.
+    std::string generate_residual_update() const;
+    /// Generates the recording and replay of queues that are built once, used by the CASPT2 driver.
+    std::string generate_queue_replay() const;
+    /// Generates the cost descriptor returned by TaskN::cost().
+    std::string generate_cost_descriptor() const;
     /// Generates code for all unique gamma.
     OutStream generate_gammas() const;
     /// Generates the algorithm to be used in BAGEL.
@@ -67,7 +67,7 @@ class Spin {
 /// A class for tensor indices. Can refer to orbital attributes: Index defined by label (space), spin, electron number and if is transposed (daggered). Also can refer to cI index.
 class Index_Core {
   protected:
-    /// Index label, related to closed, active, or virtual (c, x, and a, respectively).
+    /// Index label, related to closed, active, or virtual (c, x, and a, respectively), or auxiliary functions of density fitting (P).
     std::string label_;
     /// Index number (if orbital index, electron).
     int num_;
@@ -183,13 +183,15 @@ class Index {
         out = "active_";
       } else if (label() == "ci") {
         out = "ci_";
+      } else if (label() == "P") {
+        out = "aux_";
       } else {
         throw std::runtime_error("unkonwn index type in Index::generate()");
       }
       return out;
     }
 
-    /// Gives index range name ([0], [1], [2] for closed, active, virtual orbital spaces, respectively and [3] for ci range) based on index label.
+    /// Gives index range name ([0], [1], [2] for closed, active, virtual orbital spaces, respectively and [3] for ci or auxiliary range) based on index label.
     std::string generate_range(const std::string postfix = "") const {
       std::string out = "range" + postfix;
       if (label() == "c") {
@@ -198,7 +200,7 @@ class Index {
         out += "[1]";
       } else if (label() == "a") {
         out += "[2]";
-      } else if (label() == "ci") {
+      } else if (label() == "ci" || label() == "P") {
         out += "[3]";
       } else {
         throw std::runtime_error("unkonwn index type in Index::generate_range()");
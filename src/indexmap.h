@@ -39,6 +39,9 @@ namespace smith {
 // to more general cases (RASPT2, for instance), then just add some entry.
 // Indices will be sorted using these numbers when tensors are canonicalized.
 
+/// Returns true if v2 is density fitted, which adds the class of auxiliary indices (df_integrals in constants.h).
+bool density_fitting();
+
 /// Defines index classes.
 class IndexMap {
   protected:
@@ -51,6 +54,8 @@ class IndexMap {
       map_.push_back(std::make_pair("x", std::make_pair(1, 6)));
       map_.push_back(std::make_pair("a", std::make_pair(2, 232)));
       map_.push_back(std::make_pair("ci", std::make_pair(3, 2000)));
+      if (density_fitting())
+        map_.push_back(std::make_pair("P", std::make_pair(4, 1000)));
     }
     ~IndexMap() { }
     /// Returns map_ size.
@@ -88,6 +88,35 @@ void ListTensor::absorb_all_internal() {
 }
 
 
+void ListTensor::mark_four_external() {
+  for (auto& i : list_)
+    if (i->label() == "v2" && all_of(i->index().begin(), i->index().end(), [](shared_ptr<const Index> j) { return j->label() == "a"; }))
+      i->set_label("v2ext");
+}
+
+
+void ListTensor::expand_df() {
+  // auxiliary indices are numbered after all the others in this diagram
+  int num = 0;
+  for (auto& i : list_)
+    for (auto& j : i->index())
+      num = max(num, abs(j->num()));
+
+  for (auto i = list_.begin(); i != list_.end(); ++i) {
+    if ((*i)->label() != "v2") continue;
+    // blocks of v2 are (i3 i2|i1 i0) for the index list i0 i1 i2 i3 (see Tensor::generate_block_index), and those of df are (P|pq)
+    vector<shared_ptr<const Index>> index((*i)->index().begin(), (*i)->index().end());
+    auto aux = make_shared<Index>("P", false);
+    aux->set_num(++num);
+    auto left  = make_shared<Tensor>((*i)->factor(), "df", list<shared_ptr<const Index>>{index[2], index[3], aux});
+    auto right = make_shared<Tensor>(1.0, "df", list<shared_ptr<const Index>>{index[0], index[1], aux});
+    left->set_scalar((*i)->scalar());
+    *i = left;
+    i = list_.insert(++i, right);
+  }
+}
+
+
 void ListTensor::absorb_ket() {
   if (braket_.second) {
     assert(!braket_.first);
@@ -243,12 +272,13 @@ shared_ptr<Cost> ListTensor::calculate_cost() const {
     }
 
     sumindex.insert(sumindex.end(), outindex.begin(), outindex.end());
-    vector<int> cost(4);
+    vector<int> cost(density_fitting() ? 5 : 4);
     for (auto& a : sumindex) {
       if (a->label() == "c") cost[0] += 1;
       else if (a->label() == "x") cost[1] += 1;
       else if (a->label() == "a") cost[2] += 1;
       else if (a->label() == "ci") cost[3] += 1;
+      else if (a->label() == "P" && density_fitting()) cost[4] += 1;
       else {
         stringstream ss; ss << "this should not happen - ListTensor::calculate_cost " << a->label() << endl;
         throw logic_error(ss.str());
@@ -61,6 +61,10 @@ class ListTensor {
 
     /// Combines tensors and removes one from list. To do this, finds active tensor then merges other tensor if other tensor is all_active (has all active indices) but not if active and if not proj. Eg f1 tensor can be absorbed if all active.
     void absorb_all_internal();
+    /// Relabels all-virtual v2 as v2ext, whose blocks are formed from the DF integrals when they are retrieved (FourExternal).
+    void mark_four_external();
+    /// Replaces each v2 by two density-fitted three-index tensors df, (pq|rs) = sum_P (P|pq)(P|rs). Their order is then chosen by reorder().
+    void expand_df();
     /// Careful, only valid if wave function is not complex. This will reverse braket for gamma and reindex tensors in case of ket, allowing gamma tensors from bra case to be reused.
     void absorb_ket();
 
@@ -2634,6 +2634,11 @@ int main() {
   ds.close();
   gs.close();
   gg.close();
+  if (cost_table) {
+    ofstream ks(fr->name() + "_costs.csv");
+    ks << tmp.kk.str();
+    ks.close();
+  }
   cout << std::endl;
 
   // output
@@ -37,6 +37,7 @@ struct OutStream {
   std::stringstream dd; //name_tasks.cc
   std::stringstream ee; //name.cc
   std::stringstream gg; //name_gamma.cc
+  std::stringstream kk; //name_costs.csv
 
   OutStream() { }
   OutStream(const OutStream& o) {
@@ -46,11 +47,12 @@ struct OutStream {
     dd << o.dd.str();
     ee << o.ee.str();
     gg << o.gg.str();
+    kk << o.kk.str();
   }
   OutStream& operator=(const OutStream& a) {
-    ss.str(std::string()); tt.str(std::string()); cc.str(std::string()); dd.str(std::string()); ee.str(std::string()); gg.str(std::string());
-    ss.clear(); tt.clear(); cc.clear(); dd.clear(); ee.clear(); gg.clear();
-    ss << a.ss.str(); tt << a.tt.str(); cc << a.cc.str(); dd << a.dd.str(); ee << a.ee.str(); gg << a.gg.str();
+    ss.str(std::string()); tt.str(std::string()); cc.str(std::string()); dd.str(std::string()); ee.str(std::string()); gg.str(std::string()); kk.str(std::string());
+    ss.clear(); tt.clear(); cc.clear(); dd.clear(); ee.clear(); gg.clear(); kk.clear();
+    ss << a.ss.str(); tt << a.tt.str(); cc << a.cc.str(); dd << a.dd.str(); ee << a.ee.str(); gg << a.gg.str(); kk << a.kk.str();
     return *this;
   }
 };
@@ -63,6 +65,7 @@ OutStream& operator<<(OutStream& o, const OutStream& a) {
   o.dd << a.dd.str();
   o.ee << a.ee.str();
   o.gg << a.gg.str();
+  o.kk << a.kk.str();
   return o;
 }
 }
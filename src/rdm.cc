@@ -218,3 +218,71 @@ bool RDM::identical(shared_ptr<const RDM> o) const {
   }
   return out;
 }
+
+
+string RDM::generate_delta_axpy(string indent, const list<shared_ptr<const Index>>& index, const list<shared_ptr<const Index>>& rindex, vector<string>& close) const {
+  // i0data (rdm block with rindex) is embedded into odata (Gamma block with index) along the Kronecker deltas.
+  // Each loop index contributes to odata with the sum of the strides of all the positions it occupies.
+  stringstream tt;
+  auto rep = [this](shared_ptr<const Index> i) {
+    for (auto& d : delta_)
+      if (i->label() != "ci" && d.first->num() == i->num()) return d.second;
+    return i;
+  };
+  auto strides = [](const list<shared_ptr<const Index>>& ind) {
+    vector<string> out;
+    string prev = "1";
+    for (auto i = ind.rbegin(); i != ind.rend(); ++i) {
+      out.push_back(prev);
+      prev = (i == ind.rbegin() ? "" : prev + "*") + (*i)->str_gen() + ".size()";
+    }
+    return out;
+  };
+  auto write_table = [&](const string name, const vector<string>& s) {
+    tt << indent << "const size_t " << name << "[" << s.size() << "] = {";
+    for (auto i = s.begin(); i != s.end(); ++i)
+      tt << (i != s.begin() ? ", " : "") << *i;
+    tt << "};" << endl;
+  };
+  write_table("ostride", strides(index));
+  write_table("istride", strides(rindex));
+
+  // stride of a loop index in odata and i0data
+  auto ostride = [&](shared_ptr<const Index> v) {
+    string out;
+    int cnt = 0;
+    for (auto i = index.rbegin(); i != index.rend(); ++i, ++cnt)
+      if (rep(*i)->str_gen() == v->str_gen()) {
+        stringstream ss; ss << "ostride[" << cnt << "]";
+        out += (out.empty() ? "" : "+") + ss.str();
+      }
+    return out;
+  };
+  auto istride = [&](shared_ptr<const Index> v) {
+    int cnt = 0;
+    for (auto i = rindex.rbegin(); i != rindex.rend(); ++i, ++cnt)
+      if ((*i)->str_gen() == v->str_gen()) {
+        stringstream ss; ss << "istride[" << cnt << "]";
+        return ss.str();
+      }
+    return string();
+  };
+
+  // the fastest rdm index is treated by axpy; the others are looped over
+  const string axpy = DataType == "double" ? "daxpy_" : "zaxpy_";
+  shared_ptr<const Index> inner = rindex.back();
+  string ooff, ioff;
+  for (auto& i : index) {
+    if (rep(i)->str_gen() != i->str_gen() || i->str_gen() == inner->str_gen()) continue;
+    const string var = "i" + i->str_gen();
+    tt << indent << "for (int " << var << " = 0; " << var << " != " << i->str_gen() << ".size(); ++" << var << ") {" << endl;
+    close.push_back(indent + "}");
+    indent += "  ";
+    ooff += "+" + var + "*(" + ostride(i) + ")";
+    if (!istride(i).empty())
+      ioff += "+" + var + "*" + istride(i);
+  }
+  tt << indent << axpy << "(" << inner->str_gen() << ".size(), " << setprecision(1) << fixed << fac_
+     << ", i0data.get()" << ioff << ", 1, odata.get()" << ooff << ", " << ostride(inner) << ");" << endl;
+  return tt.str();
+}
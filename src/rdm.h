@@ -50,6 +50,9 @@ class RDM {
     /// Generates entire task code for Gamma RDM summation with merged object (additional tensor, here fock tensor) multiplication.
     virtual std::string generate_merged(std::string indent, const std::string itag, const std::list<std::shared_ptr<const Index>>& index, const std::list<std::shared_ptr<const Index>>& merged, const std::string mlab, std::vector<std::string> in_tensors, const bool use_blas) = 0;
 
+    /// Generates loops and strided axpy calls that embed the rdm block (rindex) into the Gamma block (index) along Kronecker deltas.
+    std::string generate_delta_axpy(std::string indent, const std::list<std::shared_ptr<const Index>>& index, const std::list<std::shared_ptr<const Index>>& rindex, std::vector<std::string>& close) const;
+
     /// Makes if statement in delta cases ie index equivalency check line.
     virtual std::string make_delta_if(std::string& indent, std::vector<std::string>& close) = 0;
     /// Replaces tensor labels to more general labels in(x), where x is a counter for in tensors. RDM tensors numbered before merged (fock) tensor. Eg, rdm1 is mapped to in(0), rdm2 -> in(1), and in merged case with max rdm2, f1 -> in(2).
@@ -62,9 +65,9 @@ class RDM {
     /// Generates odata (Gamma) part of for summation ie LHS in equations gamma += rdm or gamma += rdm * f1
     virtual std::string make_odata(const std::string itag, std::string& indent, const std::list<std::shared_ptr<const Index>>& index) = 0;
 
-    /// Do blas multiplication of Gamma and fock tensors...not implemented yet for subtask code!
+    /// Do blas multiplication of sorted RDM and fock tensors into Gamma (gemv, or dot if there are no target indices).
     virtual std::string make_blas_multiply(std::string indent, const std::list<std::shared_ptr<const Index>>& loop, const std::list<std::shared_ptr<const Index>>& index) = 0;
-    /// Used for blas multiplication of RDM and merged (fock) tensors. NB not implemented yet for subtask code!
+    /// Used for blas multiplication of RDM and merged (fock) tensors. Returns the merged (rows) and remaining (columns) dimensions.
     virtual std::pair<std::string, std::string> get_dim(const std::list<std::shared_ptr<const Index>>& di, const std::list<std::shared_ptr<const Index>>& index) const = 0;
 
 
@@ -176,6 +176,14 @@ string RDM00::generate_not_merged(string indent, const string tag, const list<sh
 
     tt << make_get_block(indent, "i0", inlab[rlab], index_);
 
+    if (vectorize_delta && !index_.empty()) {
+      tt << generate_delta_axpy(indent, index, index_, close);
+      for (auto iter = close.rbegin(); iter != close.rend(); ++iter)
+        tt << *iter << endl;
+      tt << lindent << "}" << endl;
+      return tt.str();
+    }
+
     // loops over delta indices
     tt << make_sort_loops(itag, indent, index, close);
 
@@ -316,6 +324,9 @@ string RDM00::generate_merged(string indent, const string tag, const list<shared
   }
 
 
+  // the rdm block has to carry exactly the merged and target indices for blas; otherwise fall back to loops
+  const bool blas = use_blas && delta_.empty() && rank() != 0 && rindex.size() == merged.size() + index.size();
+
   // if this is 4RDM
   if (rank() == 4) {
     assert(delta_.empty());
@@ -327,22 +338,26 @@ string RDM00::generate_merged(string indent, const string tag, const list<shared
           rm.push_back(r);
       for (auto d = dindex.begin(); d != dindex.end(); ++d)
         if (i->num() == (*d)->num())
-          rm.push_back(d);
+          rm2.push_back(d);
     }
     for (auto i = rm.rbegin(); i != rm.rend(); ++i)
       rindex.erase(*i);
     for (auto i = rm2.rbegin(); i != rm2.rend(); ++i)
       dindex.erase(*i);
 
-    // to simplify we do not use blas here
     tt << make_get_block(indent, "i0", inlab[rlab], rindex);
-    // loops for index and merged
-    tt << make_merged_loops(indent, itag, close, dindex, true);
-    // make odata part of summation for target
-    tt << make_odata(itag, indent, index);
-    // mulitiply data and merge on the fly
-    tt << multiply_merge(itag, indent, list<shared_ptr<const Index>>(), rindex);
-  } else if (!use_blas) {
+    if (use_blas && rindex.size() == index.size()) {
+      // rdm4f is already contracted with the fock operator; only a permutation is left
+      tt << make_sort_indices(indent, "o", rindex, index);
+    } else {
+      // loops for index and merged
+      tt << make_merged_loops(indent, itag, close, dindex, true);
+      // make odata part of summation for target
+      tt << make_odata(itag, indent, index);
+      // mulitiply data and merge on the fly
+      tt << multiply_merge(itag, indent, list<shared_ptr<const Index>>(), rindex);
+    }
+  } else if (!blas) {
     tt << make_get_block(indent, "i0", inlab[rlab], rindex);
     // loops for index and merged
     tt << make_merged_loops(indent, itag, close, dindex);
@@ -351,165 +366,12 @@ string RDM00::generate_merged(string indent, const string tag, const list<shared
     // mulitiply data and merge on the fly
     tt << multiply_merge(itag, indent, merged, rindex);
   } else {
-#if 0
-    if (rank() != 0) {
-      tt << make_get_block(indent, "i0", inlab[rlab]);
-      tt << make_sort_indices(indent, "i0", merged);
-      tt << endl;
-
-      tt << make_blas_multiply(indent, merged, index);
-      tt << endl;
-
-      if (!index.empty()) {
-        // determine mapping
-        list<shared_ptr<const Index>> source;
-        vector<int> done;
-
-        // compare rdm and merged indices
-        for (auto i = index_.rbegin(); i != index_.rend(); ++i) {
-          bool found = false;
-          for (auto& j : merged)
-            if ((*i)->identical(j)) found = true;
-          if (!found) source.push_back(*i);
-        }
-
-        // complete source
-        for (auto i = index.rbegin(); i != index.rend(); ++i) {
-          bool found = false;
-          for (auto& j : source)
-            if ((*i)->identical(j)) found = true;
-          if (!found) source.push_back(*i);
-        }
-
-        // go through odata target indices
-        for (auto j = source.begin(); j != source.end(); ++j) {
-          // check delta mapping
-          if (!delta_.empty()) {
-            bool matched_first = false;
-            bool matched_second = false;
-            shared_ptr<const Index> first_partner;
-            shared_ptr<const Index> second_partner;
-            for (auto d = delta_.begin(); d != delta_.end(); ++d) {
-              if ((d->first)->identical(*j)) {
-                matched_first = true;
-                first_partner = d->second;
-              }
-              if ((d->second)->identical(*j)) {
-                matched_second = true;
-                second_partner = d->first;
-              }
-            }
-            int cnt = 0;
-            if (!matched_first && !matched_second) {
-              for (auto i = index.rbegin(); i != index.rend(); ++i, ++cnt)
-                if ((*i)->identical(*j)) break;
-            } else if (matched_first) {
-              for (auto i = index.rbegin(); i != index.rend(); ++i, ++cnt)
-                if ((*i)->identical(*j) || first_partner->identical(*j)) break;
-            } else if (matched_second) {
-              for (auto i = index.rbegin(); i != index.rend(); ++i, ++cnt)
-                if ((*i)->identical(*j) || second_partner->identical(*j)) break;
-            }
-            if (cnt == index.size()) throw logic_error("should not happen.. RDM odata target, delta case");
-            done.push_back(cnt);
-          } else {
-            int cnt = 0;
-            for (auto i = index.rbegin(); i != index.rend(); ++i, ++cnt) {
-              if ((*i)->identical(*j)) break;
-            }
-            if (cnt == index.size()) throw logic_error("should not happen.. RDM odata target, non-delta case");
-            done.push_back(cnt);
-          }
-        }
-        tt << indent << "sort_indices<";
-        for (auto& i : done) {
-          tt << i << ",";
-        }
-        tt << "1,1,1,1>(odata_sorted, odata";
-        for (auto i = source.begin(); i != source.end(); ++i) tt << ", " << (*i)->str_gen() << ".size()";
-        tt << ");" << endl;
-        tt << endl;
-      }
-
-    } else {
-      // for rdm0 case
-      // add dscal
-      tt << indent << SCAL << "(";
-      for (auto i = merged.rbegin(); i != merged.rend(); ++i)
-        tt << (i != merged.rbegin() ? "*" : "") << (*i)->str_gen() << ".size()";
-      tt << ", " << setprecision(1) << fixed << factor() << ", " << "fdata_sorted.get(), 1);" << endl;
-
-      // sort back to target layout (odata layout)
-      list<shared_ptr<const Index>> source;
-      vector<int> done;
-      for (auto i = index.rbegin(); i != index.rend(); ++i) {
-        bool found = false;
-        for (auto& j : merged)
-          if ((*i)->identical(j)) found = true;
-        if (!found) source.push_back(*i);
-      }
-      // complete source
-      for (auto i = index.rbegin(); i != index.rend(); ++i) {
-        bool found = false;
-        for (auto& j : source)
-          if ((*i)->identical(j)) found = true;
-        if (!found) source.push_back(*i);
-      }
-
-
-      for (auto i = merged.rbegin(); i != merged.rend(); ++i) {
-        // also check if in deltas
-        bool matched_first = false;
-        bool matched_second = false;
-        shared_ptr<const Index> first_partner;
-        shared_ptr<const Index> second_partner;
-        for (auto d = delta_.begin(); d != delta_.end(); ++d) {
-          if ((d->first)->identical(*i)) {
-            matched_first = true;
-            first_partner = d->second;
-          }
-          if ((d->second)->identical(*i)) {
-            matched_second = true;
-            second_partner = d->first;
-          }
-        }
-        int cnt = 0;
-        if (!matched_first && !matched_second) {
-          for (auto j = index.rbegin(); j != index.rend(); ++j, ++cnt)
-            if ((*i)->identical(*j)) break;
-        } else if (matched_first) {
-          for (auto j = index.rbegin(); j != index.rend(); ++j, ++cnt)
-            if ((*i)->identical(*j) || first_partner->identical(*j)) break;
-        } else if (matched_second) {
-          for (auto j = index.rbegin(); j != index.rend(); ++j, ++cnt)
-            if ((*i)->identical(*j) || second_partner->identical(*j)) break;
-        }
-        if (cnt == index.size())
-          throw logic_error("should not happen.. RDM::generate");
-        done.push_back(cnt);
-      }
-      // then fill out others
-      for (int i = 0; i != index.size(); ++i) {
-        if (find(done.begin(), done.end(), i) == done.end())
-          done.push_back(i);
-      }
-      // write out
-      tt << indent << "sort_indices<";
-      for (auto& i : done)
-        tt << i << ",";
-      // add factor information
-      tt << "1,1,1,1";
-      // add source data dimensions
-      tt << ">(fdata_sorted, odata, " ;
-      for (auto iter = source.begin(); iter != source.end(); ++iter) {
-        if (iter != source.begin()) tt << ", ";
-          tt << (*iter)->str_gen() << ".size()";
-      }
-      tt << ");" << endl;
-    }
-#else
-    assert(false);
-#endif
+    tt << make_get_block(indent, "i0", inlab[rlab], rindex);
+    // merged indices run fastest in i0data_sorted, followed by the target indices in the odata layout
+    list<shared_ptr<const Index>> sindex = index;
+    for (auto& i : merged) sindex.push_back(i);
+    tt << make_sort_indices(indent, "i0", rindex, sindex);
+    tt << make_blas_multiply(indent, merged, index);
   }
   // close loops
   for (auto iter = close.rbegin(); iter != close.rend(); ++iter)
@@ -534,12 +396,11 @@ void RDM00::map_in_tensors(std::vector<string> in_tensors, map<string,string>& i
 
 string RDM00::make_get_block(string indent, string tag, string lbl, const list<shared_ptr<const Index>>& index) {
   stringstream tt;
-  tt << indent << "std::unique_ptr<" << DataType << "[]> " << tag << "data = " << lbl << "->get_block(";
-  for (auto i = index.rbegin(); i != index.rend(); ++i) {
-    if (i != index.rbegin()) tt << ", ";
-    tt << (*i)->str_gen();
-  }
-  tt << ");" << endl;
+  string listind;
+  for (auto i = index.rbegin(); i != index.rend(); ++i)
+    listind += (i != index.rbegin() ? ", " : "") + (*i)->str_gen();
+  tt << indent << "std::unique_ptr<" << DataType << "[]> " << tag << "data = " << lbl << "->get_block(" << listind << ");" << endl;
+  tt << profile_bytes__(indent, lbl, listind);
   return tt.str();
 }
 
@@ -548,22 +409,15 @@ string RDM00::make_blas_multiply(string dindent, const list<shared_ptr<const Ind
   stringstream tt;
 
   pair<string,string> t1 = get_dim(loop, index);
-  // call dgemv
   if (t1.second != "") {
-    tt << dindent << "dgemv_(\"T\", ";
-    string tt1 = t1.first == "" ? "1" : t1.first;
-    string tt2 = t1.second== "" ? "1" : t1.second;
-    tt << tt1 << ", " << tt2 << ", " << endl;
-    tt << dindent << "       " << setprecision(1) << fixed << factor() << ", i0data_sorted, " << tt1 << ", fdata_sorted, 1.0, "  << endl
-       << dindent << "       1.0, odata_sorted, 1.0);" << endl;
+    // odata(target) += factor * i0data_sorted(merged, target)^T fdata(merged)
+    const string gemv = DataType == "double" ? "dgemv_" : "zgemv_";
+    tt << dindent << gemv << "(\"T\", " << t1.first << ", " << t1.second << ", " << setprecision(1) << fixed << factor() << ", i0data_sorted.get(), " << t1.first << "," << endl
+       << dindent << "       fdata.get(), 1, 1.0, odata.get(), 1);" << endl;
+    tt << profile_flops__(dindent, t1.first, t1.second, "1");
   } else {
-    // add check..
-#if 0
-    throw logic_error("ddot needed in f1 merged");
-#else
-    // TODO need to check this when general case is available
-    tt << dindent << "odata[0] = " << setprecision(1) << fixed << factor() <<  " * " << DOT << "(" << t1.first << ", fdata_sorted, 1, i0data_sorted, 1);" << endl;
-#endif
+    tt << dindent << "odata[0] += " << setprecision(1) << fixed << factor() <<  " * " << DOT << "(" << t1.first << ", i0data_sorted.get(), 1, fdata.get(), 1);" << endl;
+    tt << profile_flops__(dindent, "1", "1", t1.first);
   }
   return tt.str();
 }
@@ -602,29 +456,32 @@ pair<string, string> RDM00::get_dim(const list<shared_ptr<const Index>>& di, con
 }
 
 
-string RDM00::make_sort_indices(string indent, string tag, const list<shared_ptr<const Index>>& loop) {
+string RDM00::make_sort_indices(string indent, string tag, const list<shared_ptr<const Index>>& source, const list<shared_ptr<const Index>>& target) {
   stringstream tt;
-    vector<int> done;
-    // then fill out others
-    for (int i = 0; i != index_.size(); ++i) {
-      if (find(done.begin(), done.end(), i) == done.end())
-        done.push_back(i);
-    }
-    // write out
-    tt << indent << "sort_indices<";
-    for (auto& i : done)
-      tt << i << ",";
+  vector<int> done;
+  for (auto i = target.rbegin(); i != target.rend(); ++i) {
+    int cnt = 0;
+    for (auto j = source.rbegin(); j != source.rend(); ++j, ++cnt)
+      if ((*i)->identical(*j)) break;
+    if (cnt == source.size()) throw logic_error("should not happen.. RDM00::make_sort_indices");
+    done.push_back(cnt);
+  }
 
-    // add factor information
-    tt << "0,1,1,1";
+  stringstream dims, size;
+  for (auto iter = source.rbegin(); iter != source.rend(); ++iter) {
+    dims << (iter != source.rbegin() ? ", " : "") << (*iter)->str_gen() << ".size()";
+    size << (iter != source.rbegin() ? "*" : "") << (*iter)->str_gen() << ".size()";
+  }
 
-    // add source data dimensions
-    tt << ">(i0data, " << tag << "data_sorted, " ;
-    for (auto iter = index_.rbegin(); iter != index_.rend(); ++iter) {
-      if (iter != index_.rbegin()) tt << ", ";
-        tt << (*iter)->str_gen() << ".size()";
-    }
-    tt << ");" << endl;
+  // odata is accumulated with the prefactor, otherwise a sorted copy of i0data is made
+  const string out = tag == "o" ? "odata" : tag + "data_sorted";
+  if (tag != "o")
+    tt << indent << "std::unique_ptr<" << DataType << "[]> " << out << "(new " << DataType << "[" << size.str() << "]);" << endl;
+  tt << indent << "sort_indices<";
+  for (auto& i : done)
+    tt << i << ",";
+  tt << (tag == "o" ? "1,1," + prefac__(fac_) : "0,1,1,1");
+  tt << ">(i0data, " << out << ", " << dims.str() << ");" << endl;
   return tt.str();
 }
 
@@ -38,8 +38,8 @@ class RDM00 : public RDM {
     std::string make_get_block(std::string indent, std::string tag, std::string lbl, const std::list<std::shared_ptr<const Index>>& index);
     /// Generates RDM and merged (fock) tensor multipication.
     std::string multiply_merge(const std::string itag, std::string& indent,  const std::list<std::shared_ptr<const Index>>& merged, const std::list<std::shared_ptr<const Index>>& index);
-    /// Generate sort_indices which makes array. This version has no addition (or factor multiplication-0111).
-    std::string make_sort_indices(std::string indent, std::string tag, const std::list<std::shared_ptr<const Index>>& loop);
+    /// Generate sort_indices of i0data (source layout) to target layout. Makes array tag+data_sorted (0111), or adds to odata with prefactor if tag is "o".
+    std::string make_sort_indices(std::string indent, std::string tag, const std::list<std::shared_ptr<const Index>>& source, const std::list<std::shared_ptr<const Index>>& target);
     /// If delta case, also makes index loops then checks to see if merged-or-delta indices are in loops..
     std::string make_merged_loops(std::string& indent, const std::string tag, std::vector<std::string>& close, const std::list<std::shared_ptr<const Index>>& index, const bool overwrite = false);
     /// Adds merged (fock) tensor with indices, used by muliply_merge member.
@@ -63,9 +63,9 @@ class RDM00 : public RDM {
     /// Generates odata (Gamma) part of for summation ie LHS in equations gamma += rdm or gamma += rdm * f1
     std::string make_odata(const std::string itag, std::string& indent, const std::list<std::shared_ptr<const Index>>& index) override;
 
-    /// Do blas multiplication of Gamma and fock tensors...not implemented yet for subtask code!
+    /// Do blas multiplication of sorted RDM and fock tensors into Gamma (gemv, or dot if there are no target indices).
     std::string make_blas_multiply(std::string indent, const std::list<std::shared_ptr<const Index>>& loop, const std::list<std::shared_ptr<const Index>>& index) override;
-    /// Used for blas multiplication of RDM and merged (fock) tensors. NB not implemented yet for subtask code!
+    /// Used for blas multiplication of RDM and merged (fock) tensors. Returns the merged (rows) and remaining (columns) dimensions.
     std::pair<std::string, std::string> get_dim(const std::list<std::shared_ptr<const Index>>& di, const std::list<std::shared_ptr<const Index>>& index) const override;
 
 
@@ -40,8 +40,8 @@ class RDMI0 : public RDM {
     std::string make_get_out_block(std::string indent, std::string tag, std::string lbl, const std::list<std::shared_ptr<const Index>>& index);
     /// Generate get block - source data to be added to target (move block).
     std::string make_out_block(std::string indent, std::string tag, std::string lbl, const std::list<std::shared_ptr<const Index>>& index);
-    /// Generate sort_indices which makes array. This version has no addition (or factor multiplication-0111).
-    std::string make_sort_indices(std::string indent, std::string tag, const std::list<std::shared_ptr<const Index>>& loop, const std::list<std::shared_ptr<const Index>>& index);
+    /// Generate sort_indices of i0data (source layout) to target layout. Makes array tag+data_sorted (0111), or adds to odata with prefactor if tag is "o".
+    std::string make_sort_indices(std::string indent, std::string tag, const std::list<std::shared_ptr<const Index>>& source, const std::list<std::shared_ptr<const Index>>& target);
     /// Generates RDM and merged (fock) tensor multipication.
     std::string multiply_merge_sources(const std::string itag, std::string& indent,  const std::list<std::shared_ptr<const Index>>& merged, const std::list<std::shared_ptr<const Index>>& index);
     /// Generates RDM and merged (fock) tensor multipication.
@@ -76,9 +76,9 @@ class RDMI0 : public RDM {
     std::string make_odata_sources(const std::string itag, std::string& indent, const std::list<std::shared_ptr<const Index>>& index);
     std::string make_odata(const std::string itag, std::string& indent, const std::list<std::shared_ptr<const Index>>& index) override;
 
-    /// Do blas multiplication of Gamma and fock tensors...not implemented yet for subtask code!
+    /// Do blas multiplication of sorted RDM and fock tensors into Gamma (gemv, or dot if there are no target indices).
     std::string make_blas_multiply(std::string indent, const std::list<std::shared_ptr<const Index>>& loop, const std::list<std::shared_ptr<const Index>>& index) override;
-    /// Used for blas multiplication of RDM and merged (fock) tensors. NB not implemented yet for subtask code!
+    /// Used for blas multiplication of RDM and merged (fock) tensors. Returns the merged (rows) and remaining (columns) dimensions.
     std::pair<std::string, std::string> get_dim(const std::list<std::shared_ptr<const Index>>& di, const std::list<std::shared_ptr<const Index>>& index) const override;
 
 
@@ -56,7 +56,7 @@ OutStream Residual::create_target(const int i) const {
   out.tt << "    ~Task" << i << "() {}" << endl;
   out.tt << "};" << endl << endl;
 
-  out.ee << "  auto " << label_ << "q = make_shared<Queue>();" << endl;
+  out.ee << "  auto " << label_ << "q = " << (state_batch ? "queue ? queue : " : "") << "make_shared<Queue>();" << endl;
   out.ee << "  auto tensor" << i << " = vector<shared_ptr<Tensor>>{" << target_name__(label_) << "};" << endl;
   out.ee << "  auto task" << i << " = make_shared<Task" << i << ">(tensor" << i << ", reset);" << endl;
   out.ee << "  " << label_ << "q->add_task(task" << i << ");" << endl << endl;
@@ -103,7 +103,7 @@ OutStream Residual::create_target_ci(const int i) const {
   out.tt << "    ~Task" << i << "() {}" << endl;
   out.tt << "};" << endl << endl;
 
-  out.ee << "  auto " << label_ << "q = make_shared<Queue>();" << endl;
+  out.ee << "  auto " << label_ << "q = " << (state_batch ? "queue ? queue : " : "") << "make_shared<Queue>();" << endl;
   out.ee << "  auto tensor" << i << " = vector<shared_ptr<Tensor>>{den0ci, den1ci, den2ci, den3ci, den4ci};" << endl;
   out.ee << "  auto task" << i << " = make_shared<Task" << i << ">(tensor" << i << ", reset);" << endl;
   out.ee << "  " << label_ << "q->add_task(task" << i << ");" << endl << endl;
@@ -221,7 +221,7 @@ OutStream Residual::generate_compute_header(const int ic, const list<shared_ptr<
   // if index is empty give dummy arg
   out.tt << "    class Task_local : public SubTask<" << (ti.empty() ? 1 : nindex) << "," << ninptensors << "> {" << endl;
   out.tt << "      protected:" << endl;
-  out.tt << "        const std::array<std::shared_ptr<const IndexRange>,3> range_;" << endl << endl;
+  out.tt << "        const std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range_;" << endl << endl;
 
   out.tt << "        const Index& b(const size_t& i) const { return this->block(i); }" << endl;
   out.tt << "        std::shared_ptr<const Tensor> in(const size_t& i) const { return this->in_tensor(i); }" << endl;
@@ -234,11 +234,11 @@ OutStream Residual::generate_compute_header(const int ic, const list<shared_ptr<
   // if index is empty use dummy index 1 to subtask
   if (ti.empty()) {
     out.tt << "        Task_local(const std::array<std::shared_ptr<const Tensor>," << ninptensors <<  ">& in, std::shared_ptr<Tensor>& out," << endl;
-    out.tt << "                   std::array<std::shared_ptr<const IndexRange>,3>& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
+    out.tt << "                   std::array<std::shared_ptr<const IndexRange>," << nrange__() << ">& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
     out.tt << "          : SubTask<1," << ninptensors << ">(std::array<const Index, 1>(), in, out), range_(ran)" << (need_e0 ? ", e0_(e)" : "") << " { }" << endl;
   } else {
     out.tt << "        Task_local(const std::array<const Index," << nindex << ">& block, const std::array<std::shared_ptr<const Tensor>," << ninptensors <<  ">& in, std::shared_ptr<Tensor>& out," << endl;
-    out.tt << "                   std::array<std::shared_ptr<const IndexRange>,3>& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
+    out.tt << "                   std::array<std::shared_ptr<const IndexRange>," << nrange__() << ">& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
     out.tt << "          : SubTask<" << nindex << "," << ninptensors << ">(block, in, out), range_(ran)" << (need_e0 ? ", e0_(e)" : "") << " { }" << endl;
   }
   out.tt << endl;
@@ -284,17 +284,29 @@ OutStream Residual::generate_compute_footer(const int ic, const list<shared_ptr<
   out.tt << "" << endl;
 
   out.tt << "    void compute_() override {" << endl;
+  out.tt << profile_scope__(ic);
   out.tt << "      if (!out_->allocated())" << endl;
   out.tt << "        out_->allocate();" << endl;
   out.tt << "      for (auto& i : in_)" << endl;
   out.tt << "        i->init();" << endl;
-  out.tt << "      for (auto& i : subtasks_) i->compute();" << endl;
+  if (screen_blocks) {
+    out.tt << "      for (auto& i : in_)" << endl;
+    out.tt << "        BlockNorms::get().update(i);" << endl;
+  }
+  if (thread_accumulate)
+    out.tt << "      BlockAccumulator::run(subtasks_, out_);" << endl;
+  else
+    out.tt << "      for (auto& i : subtasks_) i->compute();" << endl;
+  if (screen_blocks)
+    out.tt << "      BlockNorms::get().erase(out_);" << endl;
+  if (release_intermediates)
+    out.tt << generate_release(tensors);
   out.tt << "    }" << endl << endl;
 
   out.tt << "  public:" << endl;
-  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
+  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
 
-  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
+  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
   out.cc << "  array<shared_ptr<const Tensor>," << ninptensors << "> in = {{";
   for (auto i = 1; i < ninptensors + 1; ++i)
     out.cc << "t[" << i << "]" << (i < ninptensors ? ", " : "");
@@ -302,6 +314,8 @@ OutStream Residual::generate_compute_footer(const int ic, const list<shared_ptr<
 
   out.cc << "  out_ = t[0];" << endl;
   out.cc << "  in_ = in;" << endl << endl;
+  if (balance_subtasks)
+    out.cc << "  SubtaskBalancer balance;" << endl;
 
   // over original outermost indices
   if (!ti.empty()) {
@@ -332,7 +346,7 @@ OutStream Residual::generate_compute_footer(const int ic, const list<shared_ptr<
   } else {
     listind2 = listind;
   }
-  out.cc << indent << "if (t[" << (dot ? 1 : 0) << "]->is_local("<< listind2 << "))" << endl;
+  out.cc << indent << "if (" << owner__("t[" + to_string(dot ? 1 : 0) + "]", listind2, listind) << ")" << endl;
   indent += "  ";
   // add subtasks
   if (!ti.empty()) {
@@ -343,6 +357,8 @@ OutStream Residual::generate_compute_footer(const int ic, const list<shared_ptr<
   }
   out.cc << "}" << endl << endl << endl;
 
+  if (cost_table)
+    out << generate_cost(ic, tensors);
   out.tt << "    ~Task" << ic << "() {}" << endl;
   out.tt << "};" << endl << endl;
   return out;
@@ -353,55 +369,188 @@ OutStream Residual::generate_bc(const shared_ptr<BinaryContraction> i) const {
   OutStream out;
   if (depth() != 0) {
     const string bindent = "  ";
-    string dindent = bindent;
+    list<shared_ptr<const Index>> di = i->loop_indices();
 
-    out.dd << target_->generate_get_block(dindent, "o", "out()", true);
-    out.dd << target_->generate_scratch_area(dindent, "o", "out()", true); // true means zero-out
+    // with the scratch pool, the first dgemm overwrites odata_sorted and the final sort overwrites odata
+    const bool overwrite = scratch_pool && (i->tensor()->generate_dim(di).first != "" || i->next_target()->generate_dim(di).first != "");
+    if (overwrite) {
+      out.dd << target_->generate_pooled_block(bindent, "odata", "out()", target_->generate_block_index(), false);
+      out.dd << target_->generate_pooled_block(bindent, "odata_sorted", "out()", target_->generate_block_index(), false);
+    } else {
+      out.dd << target_->generate_get_block(bindent, "o", "out()", true);
+      out.dd << target_->generate_scratch_area(bindent, "o", "out()", true); // true means zero-out
+    }
+    out << generate_bc_body(i, bindent, overwrite);
+    out << generate_bc_put(i, bindent);
+  } else {  // now at bc depth 0
+    // making residual vector...
+    list<shared_ptr<const Index>> proj = i->target_index();
+    list<shared_ptr<const Index>> res;
+    assert(!(proj.size() & 1));
+    for (auto i = proj.begin(); i != proj.end(); ++i, ++i) {
+      auto j = i; ++j;
+      res.push_back(*j);
+      res.push_back(*i);
+    }
+    auto residual = make_shared<Tensor>(1.0, target_name__(label_), res);
+    vector<shared_ptr<Tensor>> op2 = { i->next_target() };
+    out << generate_compute_operators(residual, op2, i->dagger());
+  }
 
-    list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
 
+  return out;
+}
+
+
+bool Residual::fuse_siblings() const {
+  return fuse_bcs;
+}
+
+
+OutStream Residual::generate_bcs(const vector<shared_ptr<BinaryContraction>>& bcs) const {
+  // contractions accumulate into odata in turn; each works on its own odata_sorted, as their target orders differ
+  OutStream out;
+  const string bindent = "  ";
+  out.dd << target_->generate_get_block(bindent, "o", "out()", true);
+  for (auto& i : bcs) {
+    out.dd << bindent << "{" << endl;
+    out.dd << target_->generate_scratch_area(bindent + "  ", "o", "out()", true);
+    out << generate_bc_body(i, bindent + "  ", false);
+    out.dd << bindent << "}" << endl;
+  }
+  out << generate_bc_put(bcs.front(), bindent);
+  return out;
+}
+
+
+OutStream Residual::generate_bc_body(const shared_ptr<BinaryContraction> i, const string bindent, const bool overwrite) const {
+  OutStream out;
+  {
+    string dindent = bindent;
+
+    list<shared_ptr<const Index>> ti = i->target_indices();
+    list<shared_ptr<const Index>> di = i->loop_indices();
+    const pair<string, string> in = i->input_labels();
+
+    // with canonical orbitals, a closed-closed or virtual-virtual f1 only couples the block of the summed index equal to the target one.
+    // The loop over the summed blocks and the dgemm are replaced by an elementwise product; the task itself is not fused away.
+    const pair<shared_ptr<const Index>, shared_ptr<const Index>> fock = diagonal_fock && ti.size() != 0 ? i->diagonal_fock_block()
+                                                                                                       : pair<shared_ptr<const Index>, shared_ptr<const Index>>();
     // inner loop will show up here
     // but only if outer loop is not empty
-    list<shared_ptr<const Index>> di = i->loop_indices();
     vector<string> close2;
-    if (ti.size() != 0) {
+    // f1 is checked at run time (FockDiagonal); non-canonical f1 falls back to the loop over the summed blocks
+    const bool fallback = fock.first != nullptr;
+    const string inlabel = in.second;
+    pair<string, string> t0 = i->tensor()->generate_dim(di);
+    pair<string, string> t1 = i->next_target()->generate_dim(di);
+    const string tt0 = t0.first == "" ? "1" : t0.first;
+    const string tt1 = t1.first == "" ? "1" : t1.first;
+    const string ss0 = t1.second== "" ? "1" : t1.second;
+    // blocks of all summed tuples are stacked along the contracted dimension and multiplied with a single dgemm
+    const bool batch = batch_gemm && !fock.first && ti.size() != 0 && !di.empty() && (t0.first != "" || t1.first != "");
+    if (overwrite && ti.size() != 0 && !di.empty() && !batch)
+      out.dd << dindent << DataType << " beta = 0.0;" << endl;
+    if (fock.first) {
+      string findent = dindent;
       out.dd << endl;
-      for (auto iter = di.rbegin(); iter != di.rend(); ++iter, dindent += "  ") {
-        string index = (*iter)->str_gen();
-        out.dd << dindent << "for (auto& " << index << " : *" << (*iter)->generate_range("_") << ") {" << endl;
+      if (fallback) {
+        out.dd << dindent << "if (FockDiagonal::get().diagonal(" << in.first << ", *" << fock.second->generate_range("_") << ")) {" << endl;
+        findent += "  ";
+      }
+      out.dd << findent << "const Index& " << fock.second->str_gen() << " = " << fock.first->str_gen() << ";" << endl;
+      out.dd << i->tensor()->generate_get_block(findent, "i0", in.first);
+      out.dd << i->tensor()->generate_sort_indices(findent, "i0", in.first, di) << endl;
+      out.dd << i->next_target()->generate_get_block(findent, "i1", inlabel);
+      out.dd << i->next_target()->generate_sort_indices(findent, "i1", inlabel, di) << endl;
+      // only the diagonal of the f1 block contributes: odata_sorted(m,n) += f1(m,m) * i1data_sorted(m,n)
+      const string m = t0.first;
+      const string n = t1.first == "" ? "1" : t1.first;
+      out.dd << findent << "for (size_t n = 0; n != " << n << "; ++n)" << endl;
+      out.dd << findent << "  for (size_t m = 0; m != " << m << "; ++m)" << endl;
+      out.dd << findent << "    odata_sorted[m+" << m << "*n] " << (overwrite ? "=" : "+=") << " i0data_sorted[m*(" << m << "+1)] * i1data_sorted[m+" << m << "*n];" << endl;
+      out.dd << profile_flops__(findent, "1", m, n);
+      if (fallback) {
+        if (overwrite)
+          out.dd << findent << "beta = 1.0;" << endl;
+        out.dd << dindent << "} else {" << endl;
         close2.push_back(dindent + "}");
+        dindent += "  ";
       }
-    } else {
-      int cnt = 0;
-      for (auto k = di.rbegin(); k != di.rend(); ++k, cnt++)
-        out.dd << dindent << "const Index " <<  (*k)->str_gen() << " = b(" << cnt << ");" << endl;
-      out.dd << endl;
     }
+    if (ti.size() != 0 && !di.empty() && prefetch_blocks && !batch) {
+      if (!fallback)
+        out.dd << endl;
+      out.dd << i->generate_prefetch(dindent, close2);
+    } else {
+      if (ti.size() != 0) {
+        if (!fallback)
+          out.dd << endl;
+        if (batch)
+          out.dd << i->generate_stack(dindent, tt0, tt1, ss0);
+        for (auto iter = di.rbegin(); iter != di.rend(); ++iter, dindent += "  ") {
+          string index = (*iter)->str_gen();
+          out.dd << dindent << "for (auto& " << index << " : *" << (*iter)->generate_range("_") << ") {" << endl;
+          close2.push_back(dindent + "}");
+        }
+        if (screen_blocks && !di.empty())
+          out.dd << dindent << "if (" << i->generate_screening() << ") continue;" << endl;
+      } else {
+        int cnt = 0;
+        for (auto k = di.rbegin(); k != di.rend(); ++k, cnt++)
+          out.dd << dindent << "const Index " <<  (*k)->str_gen() << " = b(" << cnt << ");" << endl;
+        out.dd << endl;
+      }
 
-    // retrieving tensor_
-    out.dd << i->tensor()->generate_get_block(dindent, "i0", "in(0)");
-    out.dd << i->tensor()->generate_sort_indices(dindent, "i0", "in(0)", di) << endl;
-    // retrieving subtree_
-    string inlabel("in("); inlabel += (same_tensor__(i->tensor()->label(), i->next_target()->label()) ? "0)" : "1)");
-    out.dd << i->next_target()->generate_get_block(dindent, "i1", inlabel);
-    out.dd << i->next_target()->generate_sort_indices(dindent, "i1", inlabel, di) << endl;
+      // retrieving tensor_
+      out.dd << i->tensor()->generate_get_block(dindent, "i0", in.first);
+      out.dd << i->tensor()->generate_sort_indices(dindent, "i0", in.first, di) << endl;
+      // retrieving subtree_
+      out.dd << i->next_target()->generate_get_block(dindent, "i1", inlabel);
+      out.dd << i->next_target()->generate_sort_indices(dindent, "i1", inlabel, di) << endl;
+    }
 
     // call dgemm or ddot (if only vector - vector contraction is made)
-    {
-      pair<string, string> t0 = i->tensor()->generate_dim(di);
-      pair<string, string> t1 = i->next_target()->generate_dim(di);
+    if (batch) {
+      out.dd << dindent << "for (size_t i = 0; i != " << tt0 << "; ++i)" << endl;
+      out.dd << dindent << "  std::copy_n(i0data_sorted.get()+" << ss0 << "*i, " << ss0 << ", i0data_stacked.get()+offset+stack*i);" << endl;
+      out.dd << dindent << "for (size_t i = 0; i != " << tt1 << "; ++i)" << endl;
+      out.dd << dindent << "  std::copy_n(i1data_sorted.get()+" << ss0 << "*i, " << ss0 << ", i1data_stacked.get()+offset+stack*i);" << endl;
+      out.dd << dindent << "offset += " << ss0 << ";" << endl;
+      for (auto iter = close2.rbegin(); iter != close2.rend(); ++iter)
+        out.dd << *iter << endl;
+      close2.clear();
+      out.dd << endl;
+      dindent = bindent;
+      // K = 0 (all tuples screened) is not a valid leading dimension
+      out.dd << dindent << "if (stack != 0)" << endl;
+      out.dd << dindent << "  " << gemm__() << "(\"T\", \"N\", " << tt0 << ", " << tt1 << ", stack," << endl;
+      out.dd << dindent << "         1.0, i0data_stacked, stack, i1data_stacked, stack," << endl
+             << dindent << "         " << (overwrite ? "0.0" : "1.0") << ", odata_sorted, " << tt0 << ");" << endl;
+      if (overwrite) {
+        out.dd << dindent << "else" << endl;
+        out.dd << dindent << "  std::fill_n(odata_sorted.get(), out()->get_size(" << target_->generate_block_index() << "), 0.0);" << endl;
+      }
+      out.dd << profile_flops__(dindent, tt0, tt1, "stack");
+    } else {
       if (t0.first != "" || t1.first != "") {
-        out.dd << dindent << GEMM << "(\"T\", \"N\", ";
-        string tt0 = t0.first == "" ? "1" : t0.first;
-        string tt1 = t1.first == "" ? "1" : t1.first;
-        string ss0 = t1.second== "" ? "1" : t1.second;
+        const string beta = !overwrite ? "1.0" : (close2.empty() ? "0.0" : "beta");
+        // small all-active contractions are dispatched to compile-time sized kernels first
+        const string kernel = i->generate_active_kernel(tt0, tt1, ss0, beta);
+        const string gindent = kernel.empty() ? dindent : dindent + "  ";
+        if (!kernel.empty())
+          out.dd << dindent << kernel << endl;
+        out.dd << gindent << gemm__() << "(\"T\", \"N\", ";
         out.dd << tt0 << ", " << tt1 << ", " << ss0 << "," << endl;
-        out.dd << dindent << "       1.0, i0data_sorted, " << ss0 << ", i1data_sorted, " << ss0 << "," << endl
-           << dindent << "       1.0, odata_sorted, " << tt0;
+        out.dd << gindent << "       1.0, i0data_sorted, " << ss0 << ", i1data_sorted, " << ss0 << "," << endl
+           << gindent << "       " << beta << ", odata_sorted, " << tt0;
         out.dd << ");" << endl;
+        out.dd << profile_flops__(dindent, tt0, tt1, ss0);
+        if (overwrite && !close2.empty())
+          out.dd << dindent << "beta = 1.0;" << endl;
       } else {
-        string ss0 = t1.second== "" ? "1" : t1.second;
         out.dd << dindent << "odata_sorted[0] += ddot_(" << ss0 << ", i0data_sorted, 1, i1data_sorted, 1);" << endl;
+        out.dd << profile_flops__(dindent, "1", "1", ss0);
       }
     }
 
@@ -412,36 +561,32 @@ OutStream Residual::generate_bc(const shared_ptr<BinaryContraction> i) const {
     }
     // Inner loop ends here
 
+    // empty inner loops leave odata_sorted untouched
+    if (overwrite && !close2.empty())
+      out.dd << bindent << "if (beta == 0.0) std::fill_n(odata_sorted.get(), out()->get_size(" << target_->generate_block_index() << "), 0.0);" << endl;
     // sort buffer
     {
-      out.dd << i->target()->generate_sort_indices_target(bindent, "o", di, i->tensor(), i->next_target());
-    }
-    // put buffer
-    {
-      string label = target_->label();
-      // new interface requires indices for put_block
-      out.dd << bindent << "out()->add_block(odata";
-      list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
-      for (auto i = ti.rbegin(); i != ti.rend(); ++i)
-        out.dd << ", " << (*i)->str_gen();
-      out.dd << ");" << endl;
+      out.dd << i->target()->generate_sort_indices_target(bindent, "o", di, i->tensor(), i->next_target(), !overwrite);
     }
-  } else {  // now at bc depth 0
-    // making residual vector...
-    list<shared_ptr<const Index>> proj = i->target_index();
-    list<shared_ptr<const Index>> res;
-    assert(!(proj.size() & 1));
-    for (auto i = proj.begin(); i != proj.end(); ++i, ++i) {
-      auto j = i; ++j;
-      res.push_back(*j);
-      res.push_back(*i);
-    }
-    auto residual = make_shared<Tensor>(1.0, target_name__(label_), res);
-    vector<shared_ptr<Tensor>> op2 = { i->next_target() };
-    out << generate_compute_operators(residual, op2, i->dagger());
   }
+  return out;
+}
 
 
+OutStream Residual::generate_bc_put(const shared_ptr<BinaryContraction> i, const string bindent) const {
+  OutStream out;
+  // put buffer
+  {
+    string label = target_->label();
+    // new interface requires indices for put_block
+    out.dd << bindent << add_block__();
+    list<shared_ptr<const Index>> ti = depth() != 0 ? i->target_indices() : i->tensor()->index();
+    string index;
+    for (auto i = ti.rbegin(); i != ti.rend(); ++i)
+      index += (index.empty() ? "" : ", ") + (*i)->str_gen();
+    out.dd << (index.empty() ? "" : ", ") << index << ");" << endl;
+    out.dd << profile_bytes__(bindent, "out()", index);
+  }
   return out;
 }
 
@@ -509,7 +654,7 @@ OutStream Residual::generate_header_sources(const int ic, const list<shared_ptr<
   // if index is empty give dummy arg
   out.tt << "    class Task_local : public SubTask<" << (ti.empty() ? 1 : nindex) << ",1> {" << endl;
   out.tt << "      protected:" << endl;
-  out.tt << "        const std::array<std::shared_ptr<const IndexRange>,3> range_;" << endl << endl;
+  out.tt << "        const std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range_;" << endl << endl;
 
   out.tt << "        const Index& b(const size_t& i) const { return this->block(i); }" << endl;
   out.tt << "        std::shared_ptr<const Tensor> in(const size_t& i) const { return this->in_tensor(i); }" << endl;
@@ -521,7 +666,7 @@ OutStream Residual::generate_header_sources(const int ic, const list<shared_ptr<
   out.tt << "      public:" << endl;
   // if index is empty use dummy index 1 to subtask
   out.tt << "        Task_local(const std::array<std::shared_ptr<const Tensor>,1>& in, std::shared_ptr<Tensor>& out," << endl;
-  out.tt << "                   std::array<std::shared_ptr<const IndexRange>,3>& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
+  out.tt << "                   std::array<std::shared_ptr<const IndexRange>," << nrange__() << ">& ran" << (need_e0 ? ", const double e" : "") << ")" << endl;
   out.tt << "          : SubTask<1,1>(std::array<const Index, 1>(), in, out), range_(ran)" << (need_e0 ? ", e0_(e)" : "") << " { }" << endl;
   out.tt << endl;
   out.tt << "        void compute() override;" << endl;
@@ -563,6 +708,7 @@ OutStream Residual::generate_footer_sources(const int ic, const list<shared_ptr<
   out.tt << "" << endl;
 
   out.tt << "    void compute_() override {" << endl;
+  out.tt << profile_scope__(ic);
   out.tt << "      if (!out_->allocated())" << endl;
   out.tt << "        out_->allocate();" << endl;
   out.tt << "      for (auto& i : in_)" << endl;
@@ -571,9 +717,9 @@ OutStream Residual::generate_footer_sources(const int ic, const list<shared_ptr<
   out.tt << "    }" << endl << endl;
 
   out.tt << "  public:" << endl;
-  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
+  out.tt << "    Task" << ic << "(std::vector<std::shared_ptr<Tensor>> t, std::array<std::shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ");" << endl;
 
-  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>,3> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
+  out.cc << "Task" << ic << "::Task" << ic << "(vector<shared_ptr<Tensor>> t, array<shared_ptr<const IndexRange>," << nrange__() << "> range" << (need_e0 ? ", const double e" : "") << ") {" << endl;
   out.cc << "  array<shared_ptr<const Tensor>,1> in = {{t[1]}};" << endl;
 
   out.cc << "  out_ = t[0];" << endl;
@@ -582,6 +728,8 @@ OutStream Residual::generate_footer_sources(const int ic, const list<shared_ptr<
   out.cc << "  subtasks_.push_back(make_shared<Task_local>(in, t[0], range" << (need_e0 ? ", e" : "") << "));" << endl;
   out.cc << "}" << endl << endl << endl;
 
+  if (cost_table)
+    out << generate_cost(ic, tensors);
   out.tt << "    ~Task" << ic << "() {}" << endl;
   out.tt << "};" << endl << endl;
   return out;
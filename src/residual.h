@@ -53,6 +53,12 @@ class Residual : public Tree {
     OutStream generate_compute_header(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool = false) const override;
     OutStream generate_compute_footer(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool dot) const override;
     OutStream generate_bc(const std::shared_ptr<BinaryContraction>) const override;
+    bool fuse_siblings() const override;
+    OutStream generate_bcs(const std::vector<std::shared_ptr<BinaryContraction>>&) const override;
+    /// Generates the contraction of a binary contraction into odata, which is declared by the caller.
+    OutStream generate_bc_body(const std::shared_ptr<BinaryContraction>, const std::string bindent, const bool overwrite) const;
+    /// Generates the add_block of odata into the target block.
+    OutStream generate_bc_put(const std::shared_ptr<BinaryContraction>, const std::string bindent) const;
     OutStream generate_bc_sources(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool, const bool, const std::shared_ptr<BinaryContraction>) const override;
     OutStream generate_header_sources(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool no_outside = false) const;
     OutStream generate_footer_sources(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool dot) const;
@@ -25,6 +25,7 @@
 
 #include <iomanip>
 #include "tensor.h"
+#include "cost.h"
 #include "constants.h"
 
 #define debug_tasks
@@ -208,44 +209,64 @@ string Tensor::generate_get_block(const string cindent, const string lab, const
 #ifdef debug_tasks // if needed, eg debug
     tt  << cindent << "// tensor label: " << lbl << endl;
 #endif
-    if (!move)
-      tt << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data = " << tlab << "->get_block(";
-    else
-      tt << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data(new " << DataType << "[" << tlab << "->get_size(";
-    string listind = "";
-    if (found != string::npos) {
-      int no = 0;
-      for (auto i = index_.begin(); i != index_.end(); ++i) {
-        if (number==-1 || no==(number+1)) break;
-        if (i != index_.begin()) listind += ", ";
-        listind += (*i)->str_gen();
-        ++no;
-      }
-    } else {
-      int no = 0;
-      for (auto i = index_.rbegin(); i != index_.rend(); ++i) {
-        if (number==-1 || no==(number+1)) break;
-        if (i != index_.rbegin()) listind += ", ";
-        listind += (*i)->str_gen();
-        ++no;
-      }
-    }
-    if (merged) {
-      for (auto i = mergedlist.rbegin(); i != mergedlist.rend(); ++i) {
-        if (index_.size()!=0 || i != mergedlist.rbegin())
-          listind += ", ";
-        listind += (*i)->str_gen();
-      }
-    }
-    if (!move) {
-      tt << listind << ");" << endl;
+    const string listind = generate_block_index(number, merged, mergedlist);
+    if (move && scratch_pool) {
+      tt << generate_pooled_block(cindent, lab + "data", tlab, listind, true);
+    } else if (!move) {
+      tt << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data = " << generate_get_block_call(tlab, listind) << ";" << endl;
+      tt << profile_bytes__(cindent, tlab, listind);
     } else {
+      tt << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data(new " << DataType << "[" << tlab << "->get_size(";
       tt << listind << ")]);" << endl;
       tt << cindent << "std::fill_n(" << lab << "data.get(), " << tlab << "->get_size(" << listind << "), 0.0);" << endl;
     }
   }
-  if (!scalar_.empty() && !noscale) {
-    assert(!move);
+  if (!noscale) {
+    assert(!move || scalar_.empty());
+    tt << generate_scale(cindent, lab);
+  }
+  return tt.str();
+}
+
+
+string Tensor::generate_get_block_call(const string tlab, const string listind) const {
+  return label_ == "v2ext" ? "FourExternal::get_block(" + tlab + ", " + listind + ")" : tlab + "->get_block(" + listind + ")";
+}
+
+
+string Tensor::generate_block_index(const int number, const bool merged, const list<shared_ptr<const Index>>& mergedlist) const {
+  string listind = "";
+  if (label().find("dagger") != string::npos) {
+    int no = 0;
+    for (auto i = index_.begin(); i != index_.end(); ++i) {
+      if (number==-1 || no==(number+1)) break;
+      if (i != index_.begin()) listind += ", ";
+      listind += (*i)->str_gen();
+      ++no;
+    }
+  } else {
+    int no = 0;
+    for (auto i = index_.rbegin(); i != index_.rend(); ++i) {
+      if (number==-1 || no==(number+1)) break;
+      if (i != index_.rbegin()) listind += ", ";
+      listind += (*i)->str_gen();
+      ++no;
+    }
+  }
+  if (merged) {
+    for (auto i = mergedlist.rbegin(); i != mergedlist.rend(); ++i) {
+      if (index_.size()!=0 || i != mergedlist.rbegin())
+        listind += ", ";
+      listind += (*i)->str_gen();
+    }
+  }
+  return listind;
+}
+
+
+string Tensor::generate_scale(const string cindent, const string lab) const {
+  stringstream tt;
+  if (!scalar_.empty()) {
     tt << cindent << SCAL << "(";
     for (auto i = index_.rbegin(); i != index_.rend(); ++i)
       tt << (i != index_.rbegin() ? "*" : "") << (*i)->str_gen() << ".size()";
@@ -256,10 +277,24 @@ string Tensor::generate_get_block(const string cindent, const string lab, const
 }
 
 
+string Tensor::generate_pooled_block(const string cindent, const string name, const string tlab, const string listind, const bool zero) const {
+  // the buffer is returned to the thread-local pool when name_scratch goes out of scope
+  stringstream ss;
+  ss << cindent << "std::unique_ptr<" << DataType << "[]> " << name << ";" << endl;
+  ss << cindent << "ScratchBuffer<" << DataType << "> " << name << "_scratch(" << name << ", " << tlab << "->get_size(" << listind << "));" << endl;
+  if (zero)
+    ss << cindent << "std::fill_n(" << name << ".get(), " << tlab << "->get_size(" << listind << "), 0.0);" << endl;
+  return ss.str();
+}
+
+
 string Tensor::generate_scratch_area(const string cindent, const string lab, const string tensor_lab, const bool zero) const {
   const string lbl = tensor_lab;
   size_t found = label_.find("dagger");
 
+  if (scratch_pool)
+    return generate_pooled_block(cindent, lab + "data_sorted", lbl, generate_block_index(), zero);
+
   stringstream ss;
   // using new move/get/put block interface
   ss << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data_sorted(new " << DataType << "[" << lbl << "->get_size(";
@@ -289,7 +324,6 @@ string Tensor::generate_scratch_area(const string cindent, const string lab, con
 
 string Tensor::generate_sort_indices(const string cindent, const string lab, const string tensor_lab, const list<shared_ptr<const Index>>& loop, const bool op) const {
   stringstream ss;
-  if (!op) ss << generate_scratch_area(cindent, lab, tensor_lab, false);
 
   vector<int> map(index_.size());
   // determine mapping
@@ -334,7 +368,17 @@ string Tensor::generate_sort_indices(const string cindent, const string lab, con
     }
   }
 
+  // a block that is already in the sorted layout is used as it is (see BinaryContraction::loop_indices)
+  bool identity = true;
+  for (size_t i = 0; i != done.size(); ++i)
+    identity &= done[i] == static_cast<int>(i);
+  if (order_loops && !op && !scratch_pool && identity && prefac__(factor_) == "1,1") {
+    ss << cindent << "std::unique_ptr<" << DataType << "[]> " << lab << "data_sorted = std::move(" << lab << "data);" << endl;
+    return ss.str();
+  }
+
   // then write them out.
+  if (!op) ss << generate_scratch_area(cindent, lab, tensor_lab, false);
   ss << cindent << "sort_indices<";
   for (auto& i : done)
     ss << i << ",";
@@ -357,7 +401,7 @@ string Tensor::generate_sort_indices(const string cindent, const string lab, con
 
 
 string Tensor::generate_sort_indices_target(const string cindent, const string lab, const list<shared_ptr<const Index>>& loop,
-                                            const shared_ptr<Tensor> a, const shared_ptr<Tensor> b) const {
+                                            const shared_ptr<Tensor> a, const shared_ptr<Tensor> b, const bool accumulate) const {
   stringstream ss;
   vector<int> map(index_.size());
   ss << cindent << "sort_indices<";
@@ -397,7 +441,7 @@ string Tensor::generate_sort_indices_target(const string cindent, const string l
     ss << cnt << ",";
   }
 
-  ss << "1,1," << prefac__(factor_);
+  ss << (accumulate ? 1 : 0) << ",1," << prefac__(factor_);
   ss << ">(" << lab << "data_sorted, " << lab << "data";
   for (auto i = source.begin(); i != source.end(); ++i) ss << ", " << (*i)->str_gen() << ".size()";
   ss << ");" << endl;
@@ -487,40 +531,6 @@ string Tensor::generate_active(string indent, const string tag, const int ninpte
     }
     dd << ");" << endl;
 
-    if (use_blas) {
-      dd << indent << "std::unique_ptr<" << DataType << "[]> fdata_sorted(new " << DataType << "["<< merged_->label() << "->get_size(fhash)]);" << endl;
-
-      // make sort_indices for merged op
-      vector<int> done;
-      dd << indent << "sort_indices<";
-      for (auto i = merged.begin(); i != merged.end(); ++i) {
-        int cnt = 0;
-        for (auto j = merged.rbegin(); j != merged.rend(); ++j, ++cnt) {
-          if ((*i)->identical(*j)) break;
-        }
-        if (cnt == merged.size()) throw logic_error("should not happen... fdata sort indices");
-        done.push_back(cnt);
-      }
-      // then fill out others
-      for (int i = 0; i != merged.size(); ++i) {
-        if (find(done.begin(), done.end(), i) == done.end())
-          done.push_back(i);
-      }
-      // write out
-      for (auto& i : done)
-        dd << i << ",";
-
-      dd << "0,1,1,1";
-
-      // add source data dimensions
-      dd << ">(fdata, fdata_sorted, " ;
-      for (auto iter = merged.rbegin(); iter != merged.rend(); ++iter) {
-        if (iter != merged.rbegin()) dd << ", ";
-          dd << (*iter)->str_gen() << ".size()";
-      }
-      dd << ");" << endl;
-    }
-
     // generate merged and/or rdm
     dd << active()->generate(indent, tag, index(), merged_->index(), merged_->label(), use_blas);
 
@@ -599,8 +609,15 @@ OutStream Tensor::generate_gamma(const int ic, const bool use_blas, const bool d
   }
 
   out << generate_gamma_header(ic, use_blas, der, nindex, ninptensors);
-  out << generate_gamma_body(ic, use_blas, der, nindex, ninptensors, merged);
-  out << generate_gamma_footer(ic, use_blas, der, nindex, ninptensors, merged);
+  OutStream body = generate_gamma_body(ic, use_blas, der, nindex, ninptensors, merged);
+  out << body;
+  // the generated body identifies the Gamma in the on-disk cache (FNV-1a)
+  size_t code = 14695981039346656037ull;
+  for (auto& c : body.dd.str()) {
+    code ^= static_cast<unsigned char>(c);
+    code *= 1099511628211ull;
+  }
+  out << generate_gamma_footer(ic, use_blas, der, nindex, ninptensors, merged, code);
 
   return out;
 }
@@ -682,6 +699,7 @@ OutStream Tensor::generate_gamma_footer_sources(const int ic, const bool use_bla
   out.tt << "" << endl;
 
   out.tt << "    void compute_() override {" << endl;
+  out.tt << profile_scope__(ic);
   out.tt << "      if (!out_[0]->allocated())" << endl;
   out.tt << "        out_[0]->allocate();" << endl;
   out.tt << "      if (!out_[1]->allocated())" << endl;
@@ -708,6 +726,8 @@ OutStream Tensor::generate_gamma_footer_sources(const int ic, const bool use_bla
 
   out.cc << "  array<shared_ptr<Tensor>,5> out = {{t[0], t[1], t[2], t[3], t[4]}};" << endl;
   out.cc << "  in_ = in;" << endl;
+  if (balance_subtasks)
+    out.cc << "  SubtaskBalancer balance;" << endl;
   out.cc << "  out_ = out;" << endl << endl;
 
   // over original outermost indices
@@ -737,8 +757,12 @@ OutStream Tensor::generate_gamma_footer_sources(const int ic, const bool use_bla
     if (i != index_.rbegin()) listind += ", ";
     listind += (*i)->str_gen();
   }
+  string tuple = listind;
+  if (merged_)
+    for (auto i = merged.rbegin(); i != merged.rend(); ++i)
+      tuple += (tuple.empty() ? "" : ", ") + (*i)->str_gen();
   // the input t decides whether it is local or not --- wrong when merged
-  out.cc << cindent << "if (t[5]->is_local("<< listind << "))" << endl;
+  out.cc << cindent << "if (" << owner__("t[5]", listind, tuple) << ")" << endl;
   cindent += "  ";
   // add subtasks
   out.cc << cindent  << "subtasks_.push_back(make_shared<Task_local>(array<const Index," << nindex << ">{{" << listind;
@@ -808,9 +832,6 @@ OutStream Tensor::generate_gamma_body(const int ic, const bool use_blas, const b
 
   // generate gamma get block, true does a move_block
   out.dd << generate_get_block(indent, "o", "out()", /*move=*/true, /*noscale=*/true);
-  if (merged_) {
-    if (use_blas && !index_.empty()) out.dd << generate_scratch_area(indent, "o", "out", true);
-  }
   // now generate codes for rdm
   out.dd << generate_active(indent, "o", ninptensors, use_blas);
 
@@ -819,12 +840,13 @@ OutStream Tensor::generate_gamma_body(const int ic, const bool use_blas, const b
   for (auto i = index_.rbegin(); i != index_.rend(); ++i)
     out.dd << ", " << (*i)->str_gen();
   out.dd << ");" << endl;
+  out.dd << profile_bytes__(indent, "out()", generate_block_index());
   out.dd << "}" << endl << endl << endl;
 
   return out;
 }
 
-OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const bool der, const int nindex, const int ninptensors, const list<shared_ptr<const Index>>& merged) const {
+OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const bool der, const int nindex, const int ninptensors, const list<shared_ptr<const Index>>& merged, const size_t code) const {
   OutStream out;
 
   out.tt << "    };" << endl;
@@ -833,9 +855,16 @@ OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const
   out.tt << "" << endl;
 
   out.tt << "    void compute_() override {" << endl;
+  out.tt << profile_scope__(ic);
   out.tt << "      if (!out_->allocated())" << endl;
   out.tt << "        out_->allocate();" << endl;
+  if (gamma_cache) {
+    out.tt << "      const uint64_t key = GammaCache::get().key(0x" << hex << code << dec << "ull, in_);" << endl;
+    out.tt << "      if (GammaCache::get().load(\"" << label() << "\", key, out_)) return;" << endl;
+  }
   out.tt << "      for (auto& i : subtasks_) i->compute();" << endl;
+  if (gamma_cache)
+    out.tt << "      GammaCache::get().store(\"" << label() << "\", key, out_);" << endl;
   out.tt << "    }" << endl << endl;
 
   out.tt << "  public:" << endl;
@@ -851,6 +880,8 @@ OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const
 
   out.cc << "  out_ = t[0];" << endl;
   out.cc << "  in_ = in;" << endl << endl;
+  if (balance_subtasks)
+    out.cc << "  SubtaskBalancer balance;" << endl;
 
   // over original outermost indices
   if (!index_.empty()) {
@@ -880,7 +911,11 @@ OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const
     if (i != index_.rbegin()) listind += ", ";
     listind += (*i)->str_gen();
   }
-  out.cc << cindent << "if (t[0]->is_local("<< listind << "))" << endl;
+  string tuple = listind;
+  if (merged_)
+    for (auto i = merged.rbegin(); i != merged.rend(); ++i)
+      tuple += (tuple.empty() ? "" : ", ") + (*i)->str_gen();
+  out.cc << cindent << "if (" << owner__("t[0]", listind, tuple) << ")" << endl;
   cindent += "  ";
   // add subtasks
   out.cc << cindent  << "subtasks_.push_back(make_shared<Task_local>(array<const Index," << nindex << ">{{" << listind;
@@ -894,6 +929,26 @@ OutStream Tensor::generate_gamma_footer(const int ic, const bool use_blas, const
   out.cc << "}}, in, t[0], range));" << endl;
   out.cc << "}" << endl << endl << endl;
 
+  if (cost_table) {
+    auto size = [](const list<shared_ptr<const Index>>& index) {
+      list<string> labels;
+      for (auto& i : index) labels.push_back(i->label());
+      return MCost(labels);
+    };
+    // rdms of rank k have 2k active indices (and a ci index for derivatives), followed by f1 if merged
+    vector<MCost> in;
+    const vector<string> rdms = active_->required_rdm(!!merged_);
+    for (auto& i : rdms) {
+      list<string> labels(2*(i[i.find("rdm")+3]-'0'), "x");
+      if (der) labels.push_back("ci");
+      in.push_back(MCost(labels));
+    }
+    if (merged_)
+      in.push_back(size(merged));
+    list<shared_ptr<const Index>> all = index_;
+    all.insert(all.end(), merged.begin(), merged.end());
+    out << generate_task_cost(ic, -1, size(all) * (2*rdms.size()), size(index_), in);
+  }
   out.tt << "    ~Task" << ic << "() {}" << endl;
   out.tt << "};" << endl << endl;
 
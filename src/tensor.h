@@ -101,6 +101,8 @@ class Tensor {
     void print(std::string indent = "") const { std::cout << indent << str() << std::endl; }
     /// Set prefactor for tensor.
     void set_factor(const double a) { factor_ = a; }
+    /// Set label, used to mark tensors whose blocks are formed by generated code (see ListTensor::mark_four_external).
+    void set_label(const std::string l) { label_ = l; }
     /// Set name of scalar. Actual value is defined later on BAGEL side, eg e0.
     void set_scalar(const std::string s) { scalar_ = s; }
     /// Used to reindex tensor in absorb_ket().
@@ -143,13 +145,21 @@ class Tensor {
     std::string constructor_str(const bool diagonal = false) const;
     /// Generates code for get_block - source block to be added later to target (move) block.
     std::string generate_get_block(const std::string, const std::string, const std::string, const bool move = false, const bool noscale = false, int number = -2, bool merged = false, const std::list<std::shared_ptr<const Index>>& mergedlist = (std::list<std::shared_ptr<const Index>>())) const;
+    /// Returns the expression that retrieves block listind of tensor tlab (formed from the DF integrals for v2ext).
+    std::string generate_get_block_call(const std::string tlab, const std::string listind) const;
+    /// Returns the comma-separated block indices passed to get_block (transposed for daggered tensors).
+    std::string generate_block_index(int number = -2, bool merged = false, const std::list<std::shared_ptr<const Index>>& mergedlist = (std::list<std::shared_ptr<const Index>>())) const;
+    /// Generates code that scales a retrieved block by scalar_ (e.g. e0). Empty if there is no scalar.
+    std::string generate_scale(const std::string, const std::string) const;
+    /// Generates code that draws a buffer of the block size from the thread-local scratch pool.
+    std::string generate_pooled_block(const std::string cindent, const std::string name, const std::string tlab, const std::string listind, const bool zero) const;
     /// Generate code for unique_ptr scratch arrays.
     std::string generate_scratch_area(const std::string, const std::string, const std::string tensor_lab, const bool zero = false) const;
     /// Generate code for sort_indices. Based on operations needed to sort input tensor to output tensor.
     std::string generate_sort_indices(const std::string, const std::string, const std::string, const std::list<std::shared_ptr<const Index>>&, const bool op = false) const;
     /// Generate code for final sort_indices back to target indices (those not summed over).
     std::string generate_sort_indices_target(const std::string, const std::string, const std::list<std::shared_ptr<const Index>>&,
-                                             const std::shared_ptr<Tensor>, const std::shared_ptr<Tensor>) const;
+                                             const std::shared_ptr<Tensor>, const std::shared_ptr<Tensor>, const bool accumulate = true) const;
     /// Obtain dimensions for code for tensor multiplication in dgemm.
     std::pair<std::string, std::string> generate_dim(const std::list<std::shared_ptr<const Index>>&) const;
     /// Generates code for RDMs.
@@ -166,7 +176,7 @@ class Tensor {
     OutStream generate_gamma(const int, const bool use_blas, const bool der) const;
     OutStream generate_gamma_header(const int, const bool use_blas, const bool der, const int nindex, const int ninptensors) const;
     OutStream generate_gamma_body(const int, const bool, const bool, const int, const int, const std::list<std::shared_ptr<const Index>>&) const;
-    OutStream generate_gamma_footer(const int, const bool, const bool, const int, const int, const std::list<std::shared_ptr<const Index>>&) const;
+    OutStream generate_gamma_footer(const int, const bool, const bool, const int, const int, const std::list<std::shared_ptr<const Index>>&, const size_t code = 0) const;
     /// Returns Gamma number.
     int num() const { assert(is_gamma()); return num_; }
     /// Set Gamma number.
@@ -185,6 +195,11 @@ class Tensor {
       else if (blabel == "f1") out = false;
       else if (alabel == "v2") out = true;
       else if (blabel == "v2") out = false;
+      else if (alabel == "v2ext") out = true;
+      else if (blabel == "v2ext") out = false;
+      else if (alabel == "df" && blabel == "df") out = a->str() < b->str();
+      else if (alabel == "df") out = true;
+      else if (blabel == "df") out = false;
       else if (alabel == "t2dagger") out = true;
       else if (blabel == "t2dagger") out = false;
       else if (alabel == "t2") out = true;
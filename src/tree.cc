@@ -23,6 +23,7 @@
 //
 
 
+#include <set>
 #include "energy.h"
 #include "residual.h"
 #include "constants.h"
@@ -31,6 +32,14 @@ using namespace std;
 using namespace smith;
 
 
+bool smith::density_fitting() {
+  return df_integrals;
+}
+
+
+map<string, int> Tree::consumers_;
+
+
 Tree::Tree(shared_ptr<Equation> eq, string lab) : parent_(NULL), tree_name_(eq->name()), num_(-1), label_(lab), root_targets_(eq->targets()) {
   // First make ListTensor for all the diagrams
   list<shared_ptr<Diagram>> d = eq->diagram();
@@ -45,6 +54,12 @@ Tree::Tree(shared_ptr<Equation> eq, string lab) : parent_(NULL), tree_name_(eq->
     // rearrange brakets and reindex associated tensors, ok if not complex
     tmp->absorb_ket();
 
+    if (four_external)
+      tmp->mark_four_external();
+    // ci derivatives use the fourth index range for ci coefficients
+    if (df_integrals && label_.find("deci") == string::npos)
+      tmp->expand_df();
+
     shared_ptr<Tensor> first = tmp->front();
     shared_ptr<ListTensor> rest = tmp->rest();
 
@@ -266,6 +281,122 @@ list<shared_ptr<Tensor>> Tree::gather_gamma() const {
 }
 
 
+void Tree::count_consumers(map<string, int>& count) const {
+  for (auto& i : bc_) {
+    for (auto& j : i->subtree())
+      // recursive call
+      j->count_consumers(count);
+    vector<shared_ptr<Tensor>> tensors = i->tensors_vec();
+    for (auto j = ++tensors.begin(); j != tensors.end(); ++j)
+      if ((*j)->label().find("I") != string::npos) ++count[(*j)->label()];
+  }
+  for (auto& i : op_)
+    if (i->label().find("I") != string::npos) ++count[i->label()];
+}
+
+
+OutStream Tree::generate_cost(const int ic, const vector<shared_ptr<Tensor>>& tensors) const {
+  auto size = [](const list<shared_ptr<const Index>>& index) {
+    list<string> labels;
+    for (auto& i : index) labels.push_back(i->label());
+    return MCost(labels);
+  };
+  auto names = [](const list<shared_ptr<const Index>>& index) {
+    set<string> out;
+    for (auto& i : index) out.insert(i->str_gen());
+    return out;
+  };
+
+  // the top of trees with target indices is filled by sorting (see generate_compute_operators)
+  const list<shared_ptr<const Index>> target = depth() == 0 && root_targets() ? tensors[1]->index() : tensors.front()->index();
+
+  // inputs as in in_, i.e., distinct tensors in the order of their first appearance
+  vector<MCost> in;
+  vector<string> done;
+  list<shared_ptr<const Index>> all = target;
+  bool elementwise = true;
+  for (auto i = ++tensors.begin(); i != tensors.end(); ++i) {
+    elementwise &= names((*i)->index()) == names(target);
+    for (auto& j : (*i)->index())
+      if (none_of(all.begin(), all.end(), [&j](shared_ptr<const Index> k) { return k->str_gen() == j->str_gen(); }))
+        all.push_back(j);
+    const string label = (*i)->label();
+    if (any_of(done.begin(), done.end(), [&label](const string& j) { return same_tensor__(label, j); })) continue;
+    in.push_back(size((*i)->index()));
+    done.push_back(label);
+  }
+  const MCost out = size(target);
+  // operators are added to the target, whereas a contraction is a multiply-add over all indices
+  MCost flops = elementwise ? out * (tensors.size()-1) : size(all) * (all.size() != target.size() ? 2 : 1);
+  // tasks of fused contractions (fuse_bcs) list their operands in pairs
+  if (!elementwise && tensors.size() > 3) {
+    flops = MCost();
+    for (auto i = ++tensors.begin(); i != tensors.end(); ++i, ++i) {
+      list<shared_ptr<const Index>> indices = target;
+      for (auto& t : {*i, *next(i)})
+        for (auto& j : t->index())
+          if (none_of(indices.begin(), indices.end(), [&j](shared_ptr<const Index> k) { return k->str_gen() == j->str_gen(); }))
+            indices.push_back(j);
+      flops += size(indices) * (indices.size() != target.size() ? 2 : 1);
+    }
+  }
+  return generate_task_cost(ic, depth(), flops, out, in);
+}
+
+
+void Tree::simulate_memory(map<string, MCost>& live, vector<MCost>& peaks) const {
+  auto name = [](const string& label) { return label.substr(0, label.find("dagger")); };
+  // output is allocated when the first task that writes to it is run
+  auto allocate = [&](shared_ptr<const Tensor> t) {
+    if (t->label().find("I") == string::npos || live.count(name(t->label()))) return;
+    list<string> labels;
+    for (auto& i : t->index()) labels.push_back(i->label());
+    live.emplace(name(t->label()), MCost(labels));
+    MCost total;
+    for (auto& i : live) total += i.second;
+    peaks.push_back(total);
+  };
+  auto release = [&](const vector<shared_ptr<Tensor>>& tensors) {
+    if (!release_intermediates) return;
+    for (auto& i : tensors) {
+      auto iter = consumers_.find(i->label());
+      if (i->label().find("I") != string::npos && iter != consumers_.end() && iter->second == 1)
+        live.erase(name(i->label()));
+    }
+  };
+
+  // the task for op_ does not depend on other tasks and runs first
+  if (!op_.empty()) {
+    allocate(target_);
+    release(op_);
+  }
+  for (auto& i : bc_) {
+    for (auto& j : i->subtree())
+      // recursive call
+      j->simulate_memory(live, peaks);
+    vector<shared_ptr<Tensor>> tensors = i->tensors_vec();
+    allocate(tensors.front());
+    release(vector<shared_ptr<Tensor>>(++tensors.begin(), tensors.end()));
+  }
+}
+
+
+string Tree::generate_release(const vector<shared_ptr<Tensor>>& tensors) const {
+  stringstream tt;
+  // in_ holds distinct input tensors in the order of their first appearance
+  vector<string> done;
+  for (auto i = ++tensors.begin(); i != tensors.end(); ++i) {
+    const string label = (*i)->label();
+    if (any_of(done.begin(), done.end(), [&label](const string& j) { return same_tensor__(label, j); })) continue;
+    auto iter = consumers_.find(label);
+    if (label.find("I") != string::npos && iter != consumers_.end() && iter->second == 1)
+      tt << "      std::const_pointer_cast<Tensor>(in_[" << done.size() << "])->deallocate();" << endl;
+    done.push_back(label);
+  }
+  return tt.str();
+}
+
+
 string BinaryContraction::target_index_str() const {
   stringstream zz;
   if (!target_index_.empty()) {
@@ -329,6 +460,55 @@ static string label__(const string& lbl) {
   }
   return label;
 }
+
+// registers an intermediate with the queue that writes it, so that a replayed queue starts from a zero intermediate
+static string keep__(const string& queue, shared_ptr<const Tensor> s) {
+  if (s->label().find("I") == string::npos) return "";
+  return "  QueueReplay::get().add_intermediate(" + queue + "q, " + s->label() + ");\n";
+}
+
+// copy of a 4-index source tensor whose indices are swapped so that it is daggered with respect to the target indices di
+static shared_ptr<Tensor> daggered__(shared_ptr<Tensor> s, const list<shared_ptr<const Index>>& di) {
+  shared_ptr<Tensor> top = make_shared<Tensor>(*s);
+  // swap operators so that tensor is daggered
+  if (top->index().size() != 4)
+     throw logic_error("Daggered object is only supported for 4-index tensors");
+  auto k0 = di.begin(); auto k1 = k0; ++k1; auto k2 = k1; ++k2; auto k3 = k2; ++k3;
+  list<pair<list<shared_ptr<const Index>>::const_iterator, list<shared_ptr<const Index>>::const_iterator>> map;
+  map.push_back(make_pair(k0, k2));
+  map.push_back(make_pair(k2, k0));
+  map.push_back(make_pair(k1, k3));
+  map.push_back(make_pair(k3, k1));
+  list<shared_ptr<const Index>> tmp;
+  for (auto& k : top->index()) {
+    for (auto l = map.begin(); l != map.end(); ++l) {
+      if (k->identical(*l->first)) {
+        tmp.push_back(*l->second);
+        break;
+      }
+      auto ll = l;
+      if (++ll == map.end()) throw logic_error("should not happen: dagger stuffs");
+    }
+  }
+  top->index() = tmp;
+  return top;
+}
+
+// offset of the element (i<index>...) in a block whose indices are given in order (fastest first), e.g. ix0+x0.size()*(ix1)
+static string fused_offset__(const vector<shared_ptr<const Index>>& order, const list<shared_ptr<const Index>>& target) {
+  string out;
+  string close;
+  for (auto i = order.begin(); i != order.end(); ++i) {
+    auto t = find_if(target.begin(), target.end(), [&i](shared_ptr<const Index> j) { return (*i)->identical(j); });
+    if (t == target.end()) throw logic_error("should not happen.. fused_offset__");
+    out += "i" + (*t)->str_gen();
+    if (i+1 != order.end()) {
+      out += "+" + (*t)->str_gen() + ".size()*(";
+      close += ")";
+    }
+  }
+  return out + close;
+}
 // local functions... (not a good practice...) <<<<<<<<<<<<<<<<<<<<<<<<<<<<<<
 
 
@@ -355,10 +535,177 @@ list<shared_ptr<const Index>> BinaryContraction::loop_indices() {
       out.push_back(*iter);
     }
   }
+  // the summed indices are ordered so that the larger operand is already stored in the layout of dgemm (its sort is then a move)
+  if (order_loops && out.size() > 0) {
+    // operands are compared by their number of elements with the typical sizes of index classes (see MCost::estimate)
+    auto size = [](shared_ptr<const Tensor> t) {
+      list<string> labels;
+      for (auto& i : t->index()) labels.push_back(i->label());
+      return MCost(labels).estimate();
+    };
+    vector<shared_ptr<const Tensor>> operands = {next_target(), tensor_};
+    if (size(tensor_) > size(next_target()))
+      swap(operands[0], operands[1]);
+    for (auto& t : operands) {
+      // storage order, fastest first (see Tensor::generate_sort_indices)
+      const bool trans = t->label().find("dagger") != string::npos;
+      vector<shared_ptr<const Index>> storage(t->index().begin(), t->index().end());
+      if (!trans)
+        reverse(storage.begin(), storage.end());
+      list<shared_ptr<const Index>> ordered;
+      for (auto i = storage.begin(); i != storage.begin() + min(storage.size(), out.size()); ++i) {
+        auto j = find_if(out.begin(), out.end(), [&i](shared_ptr<const Index> k) { return k->identical(*i); });
+        if (j == out.end()) break;
+        // the last summed index is the outermost loop and the fastest in the contracted dimension
+        ordered.push_front(*j);
+      }
+      if (ordered.size() == out.size())
+        return ordered;
+    }
+  }
+  return out;
+}
+
+
+pair<shared_ptr<const Index>, shared_ptr<const Index>> BinaryContraction::diagonal_fock_block() {
+  pair<shared_ptr<const Index>, shared_ptr<const Index>> out;
+  const list<shared_ptr<const Index>>& index = tensor_->index();
+  if (tensor_->label().find("f1") == string::npos || index.size() != 2 || index.front()->label() != index.back()->label()
+      || (index.front()->label() != "c" && index.front()->label() != "a"))
+    return out;
+  list<shared_ptr<const Index>> di = loop_indices();
+  if (di.size() != 1)
+    return out;
+  out.second = di.front();
+  out.first = index.front()->str_gen() == di.front()->str_gen() ? index.back() : index.front();
   return out;
 }
 
 
+string BinaryContraction::generate_active_kernel(const string& m, const string& n, const string& k, const string& beta) {
+  auto active = [](const shared_ptr<const Index>& i) { return i->active(); };
+  const list<shared_ptr<const Index>>& index0 = tensor_->index();
+  const list<shared_ptr<const Index>>& index1 = next_target()->index();
+  if (!active_kernels || !all_of(index0.begin(), index0.end(), active) || !all_of(index1.begin(), index1.end(), active))
+    return "";
+  const int nloop = loop_indices().size();
+  stringstream ss;
+  ss << "if (!ActiveKernel<" << index0.size()-nloop << "," << index1.size()-nloop << "," << nloop << ">::gemm(" << index0.front()->str_gen() << ".size(), "
+     << m << ", " << n << ", " << k << ", i0data_sorted, i1data_sorted, " << beta << ", odata_sorted))";
+  return ss.str();
+}
+
+
+string BinaryContraction::generate_stack(const string& dindent, const string& m, const string& n, const string& k) {
+  // the summed dimension is only known after a pass over the (unscreened) tuples
+  stringstream ss;
+  list<shared_ptr<const Index>> di = loop_indices();
+  ss << dindent << "size_t stack = 0;" << endl;
+  string lindent = dindent;
+  for (auto iter = di.rbegin(); iter != di.rend(); ++iter, lindent += "  ")
+    ss << lindent << "for (auto& " << (*iter)->str_gen() << " : *" << (*iter)->generate_range("_") << ")" << endl;
+  if (screen_blocks)
+    ss << lindent << "if (!(" << generate_screening() << "))" << endl;
+  ss << lindent << (screen_blocks ? "  " : "") << "stack += " << k << ";" << endl;
+  ss << dindent << "std::unique_ptr<" << DataType << "[]> i0data_stacked(new " << DataType << "[stack*" << m << "]);" << endl;
+  ss << dindent << "std::unique_ptr<" << DataType << "[]> i1data_stacked(new " << DataType << "[stack*" << n << "]);" << endl;
+  ss << dindent << "size_t offset = 0;" << endl;
+  return ss.str();
+}
+
+
+// kept outside BinaryContraction so that its layout, and hence the heap order that fixes the order of generated code, does not change;
+// entries only live while a fused task is generated (see Tree::generate_fused), so that no address outlives its contraction
+static map<const BinaryContraction*, pair<string, string>> input_labels__;
+
+void BinaryContraction::set_input_labels(const string& a, const string& b) {
+  input_labels__[this] = make_pair(a, b);
+}
+
+
+void BinaryContraction::reset_input_labels() {
+  input_labels__.erase(this);
+}
+
+
+pair<string, string> BinaryContraction::input_labels() {
+  auto iter = input_labels__.find(this);
+  if (iter != input_labels__.end())
+    return iter->second;
+  return make_pair(string("in(0)"), string(same_tensor__(tensor_->label(), next_target()->label()) ? "in(0)" : "in(1)"));
+}
+
+
+string BinaryContraction::generate_screening() {
+  const pair<string, string> in = input_labels();
+  stringstream ss;
+  auto norm = [](const shared_ptr<const Tensor> t, const string& label) {
+    return (t->label() == "v2ext" ? "FourExternal::norm(" : "BlockNorms::get().norm(") + label + ", " + t->generate_block_index() + ")";
+  };
+  ss << norm(tensor_, in.first) << "*" << norm(next_target(), in.second) << " < BlockNorms::get().thresh()";
+  return ss.str();
+}
+
+
+string BinaryContraction::generate_prefetch(string& dindent, vector<string>& close) {
+  // inner loops are flattened so that the blocks of iteration n+1 are retrieved asynchronously while iteration n is contracted
+  stringstream ss;
+  list<shared_ptr<const Index>> di = loop_indices();
+  const int nloop = di.size();
+  const pair<string, string> in = input_labels();
+  const string inlabel = in.second;
+
+  ss << dindent << "std::vector<std::array<const Index," << nloop << ">> blocks;" << endl;
+  ss << dindent << "blocks.reserve(";
+  for (auto iter = di.rbegin(); iter != di.rend(); ++iter)
+    ss << (iter != di.rbegin() ? "*" : "") << (*iter)->generate_range("_") << "->nblock()";
+  ss << ");" << endl;
+  string lindent = dindent;
+  for (auto iter = di.rbegin(); iter != di.rend(); ++iter, lindent += "  ")
+    ss << lindent << "for (auto& " << (*iter)->str_gen() << " : *" << (*iter)->generate_range("_") << ")" << endl;
+  if (screen_blocks)
+    ss << lindent << "if (!(" << generate_screening() << "))" << endl;
+  ss << lindent << (screen_blocks ? "  " : "") << "blocks.push_back(std::array<const Index," << nloop << ">{{";
+  for (auto iter = di.rbegin(); iter != di.rend(); ++iter)
+    ss << (iter != di.rbegin() ? ", " : "") << (*iter)->str_gen();
+  ss << "}});" << endl;
+
+  auto unpack = [&](const string indent, const string n) {
+    int cnt = 0;
+    for (auto iter = di.rbegin(); iter != di.rend(); ++iter, ++cnt)
+      ss << indent << "const Index& " << (*iter)->str_gen() << " = blocks[" << n << "][" << cnt << "];" << endl;
+  };
+  ss << dindent << "auto fetch = [&](const size_t n) {" << endl;
+  unpack(dindent + "  ", "n");
+  ss << dindent << "  return std::make_pair(" << tensor_->generate_get_block_call(in.first, tensor_->generate_block_index()) << ", "
+                                     << next_target()->generate_get_block_call(inlabel, next_target()->generate_block_index()) << ");" << endl;
+  ss << dindent << "};" << endl;
+  ss << dindent << "std::future<decltype(fetch(0))> next;" << endl;
+  ss << dindent << "if (!blocks.empty())" << endl;
+  ss << dindent << "  next = BlockFetcher::get().submit([&fetch] { return fetch(0); });" << endl;
+  ss << dindent << "for (size_t n = 0; n != blocks.size(); ++n) {" << endl;
+  close.push_back(dindent + "}");
+  dindent += "  ";
+  unpack(dindent, "n");
+  ss << dindent << "auto current = next.get();" << endl;
+  ss << dindent << "if (n+1 != blocks.size())" << endl;
+  ss << dindent << "  next = BlockFetcher::get().submit([&fetch, n] { return fetch(n+1); });" << endl;
+
+  // retrieving tensor_
+  ss << dindent << "std::unique_ptr<" << DataType << "[]> i0data = std::move(current.first);" << endl;
+  // counted here since fetch runs on another thread
+  ss << profile_bytes__(dindent, in.first, tensor_->generate_block_index());
+  ss << tensor_->generate_scale(dindent, "i0");
+  ss << tensor_->generate_sort_indices(dindent, "i0", in.first, di) << endl;
+  // retrieving subtree_
+  ss << dindent << "std::unique_ptr<" << DataType << "[]> i1data = std::move(current.second);" << endl;
+  ss << profile_bytes__(dindent, inlabel, next_target()->generate_block_index());
+  ss << next_target()->generate_scale(dindent, "i1");
+  ss << next_target()->generate_sort_indices(dindent, "i1", inlabel, di) << endl;
+  return ss.str();
+}
+
+
 OutStream Tree::generate_compute_operators(shared_ptr<Tensor> target, const vector<shared_ptr<Tensor>> op, const bool dagger) const {
   OutStream out;
 
@@ -390,45 +737,27 @@ OutStream Tree::generate_compute_operators(shared_ptr<Tensor> target, const vect
   }
 
   // add the source data to the target
-  int j = 0;
-  for (auto s = op.begin(); s != op.end(); ++s, ++j) {
-    stringstream uu; uu << "i" << j;
-    out.dd << cindent << "{" << endl;
-
-    // uses map to give label number consistent with operator, needed in case label is repeated (eg ccaa)
-    string label = label__((*s)->label());
-    stringstream instr; instr << "in(" << op_tensor_lab[label] << ")";
-
-    out.dd << (*s)->generate_get_block(cindent+"  ", uu.str(), instr.str());
-    list<shared_ptr<const Index>> di = target->index();
-    out.dd << (*s)->generate_sort_indices(cindent+"  ", uu.str(), instr.str(), di, true);
-    out.dd << cindent << "}" << endl;
-
-    // if this is at the top-level and needs to be daggered:
-    if (depth() == 0 && dagger) {
-      shared_ptr<Tensor> top = make_shared<Tensor>(**s);
-      // swap operators so that tensor is daggered
-      if (top->index().size() != 4) {
-         throw logic_error("Daggered object is only supported for 4-index tensors");
-      } else {
-        auto k0 = di.begin(); auto k1 = k0; ++k1; auto k2 = k1; ++k2; auto k3 = k2; ++k3;
-        list<pair<list<shared_ptr<const Index>>::iterator, list<shared_ptr<const Index>>::iterator>> map;
-        map.push_back(make_pair(k0, k2));
-        map.push_back(make_pair(k2, k0));
-        map.push_back(make_pair(k1, k3));
-        map.push_back(make_pair(k3, k1));
-        list<shared_ptr<const Index>> tmp;
-        for (auto& k : top->index()) {
-          for (auto l = map.begin(); l != map.end(); ++l) {
-            if (k->identical(*l->first)) {
-              tmp.push_back(*l->second);
-              break;
-            }
-            auto ll = l;
-            if (++ll == map.end()) throw logic_error("should not happen: dagger stuffs");
-          }
-        }
-        top->index() = tmp;
+  const bool top_dagger = depth() == 0 && dagger;
+  if (fuse_sources && !target->index().empty() && op.size()*(top_dagger ? 2 : 1) > 1) {
+    out.dd << generate_fused_sources(cindent, target, op, op_tensor_lab, top_dagger);
+  } else {
+    int j = 0;
+    for (auto s = op.begin(); s != op.end(); ++s, ++j) {
+      stringstream uu; uu << "i" << j;
+      out.dd << cindent << "{" << endl;
+
+      // uses map to give label number consistent with operator, needed in case label is repeated (eg ccaa)
+      string label = label__((*s)->label());
+      stringstream instr; instr << "in(" << op_tensor_lab[label] << ")";
+
+      out.dd << (*s)->generate_get_block(cindent+"  ", uu.str(), instr.str());
+      list<shared_ptr<const Index>> di = target->index();
+      out.dd << (*s)->generate_sort_indices(cindent+"  ", uu.str(), instr.str(), di, true);
+      out.dd << cindent << "}" << endl;
+
+      // if this is at the top-level and needs to be daggered:
+      if (depth() == 0 && dagger) {
+        shared_ptr<Tensor> top = daggered__(*s, di);
         out.dd << cindent << "{" << endl;
         out.dd << top->generate_get_block(cindent+"  ", uu.str(), instr.str());
         list<shared_ptr<const Index>> di = target->index();
@@ -442,10 +771,11 @@ OutStream Tree::generate_compute_operators(shared_ptr<Tensor> target, const vect
   {
     string label = target->label();
     list<shared_ptr<const Index>> ti = target->index();
-    out.dd << cindent << "out()->add_block(odata";
+    string index;
     for (auto i = ti.rbegin(); i != ti.rend(); ++i)
-      out.dd << ", " << (*i)->str_gen();
-    out.dd << ");" << endl;
+      index += (index.empty() ? "" : ", ") + (*i)->str_gen();
+    out.dd << cindent << add_block__() << (index.empty() ? "" : ", ") << index << ");" << endl;
+    out.dd << profile_bytes__(cindent, "out()", index);
   }
   for (auto iter = close.rbegin(); iter != close.rend(); ++iter)
     out.dd << *iter << endl;
@@ -453,6 +783,64 @@ OutStream Tree::generate_compute_operators(shared_ptr<Tensor> target, const vect
 }
 
 
+string Tree::generate_fused_sources(const string cindent, shared_ptr<Tensor> target, const vector<shared_ptr<Tensor>> op, const map<string, int>& op_tensor_lab, const bool dagger) const {
+  stringstream ss;
+  const list<shared_ptr<const Index>> di = target->index();
+
+  // all source blocks (and their daggered copies) are retrieved first
+  vector<shared_ptr<Tensor>> sources;
+  vector<string> labels;
+  for (auto& s : op) {
+    const string instr = "in(" + to_string(op_tensor_lab.at(label__(s->label()))) + ")";
+    sources.push_back(s);
+    labels.push_back(instr);
+    if (dagger) {
+      sources.push_back(daggered__(s, di));
+      labels.push_back(instr);
+    }
+  }
+  ss << cindent << "{" << endl;
+  for (size_t j = 0; j != sources.size(); ++j)
+    ss << sources[j]->generate_get_block(cindent+"  ", "i" + to_string(j), labels[j]);
+
+  // the output block is swept once in its storage order; the two fastest indices are tiled so that transposed sources are read in cache-sized pieces
+  const vector<shared_ptr<const Index>> order(di.rbegin(), di.rend());
+  const int ntile = order.size() > 1 ? 2 : 0;
+  string indent = cindent + "  ";
+  vector<string> close;
+  auto open = [&](const string var, const string begin, const string end, const string step) {
+    ss << indent << "for (size_t " << var << " = " << begin << "; " << var << " < " << end << "; " << (step.empty() ? "++" + var : var + step) << ") {" << endl;
+    close.push_back(indent + "}");
+    indent += "  ";
+  };
+  for (int k = order.size()-1; k >= ntile; --k)
+    open("i" + order[k]->str_gen(), "0", order[k]->str_gen() + ".size()", "");
+  for (int k = ntile-1; k >= 0; --k)
+    open("j" + order[k]->str_gen(), "0", order[k]->str_gen() + ".size()", " += " + to_string(source_tile));
+  for (int k = ntile-1; k >= 0; --k) {
+    const string j = "j" + order[k]->str_gen();
+    open("i" + order[k]->str_gen(), j, "std::min(" + j + "+" + to_string(source_tile) + ", " + order[k]->str_gen() + ".size())", "");
+  }
+
+  ss << indent << "odata[" << fused_offset__(order, di) << "]" << endl;
+  for (size_t j = 0; j != sources.size(); ++j) {
+    const list<shared_ptr<const Index>>& index = sources[j]->index();
+    // daggered tensors are stored in their index order, others in the reverse order (see generate_sort_indices)
+    const vector<shared_ptr<const Index>> sorder = sources[j]->label().find("dagger") != string::npos ? vector<shared_ptr<const Index>>(index.begin(), index.end())
+                                                                                                     : vector<shared_ptr<const Index>>(index.rbegin(), index.rend());
+    const string prefac = prefac__(sources[j]->factor());
+    const string num = prefac.substr(0, prefac.find(','));
+    const string den = prefac.substr(prefac.find(',')+1);
+    ss << indent << (j == 0 ? "  += " : "   + ") << "(" << num << ".0" << (den == "1" ? "" : "/" + den + ".0") << ") * i" << j << "data[" << fused_offset__(sorder, di) << "]"
+       << (j+1 == sources.size() ? ";" : "") << endl;
+  }
+  for (auto i = close.rbegin(); i != close.rend(); ++i)
+    ss << *i << endl;
+  ss << cindent << "}" << endl;
+  return ss.str();
+}
+
+
 OutStream Tree::generate_task_ci(const int ic, const vector<shared_ptr<Tensor>> op, const list<shared_ptr<Tensor>> g, const int iz, const bool diagonal) const {
   OutStream out;
 
@@ -545,8 +933,25 @@ tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
   OutStream out, tmp;
   string depends, tasks, specials;
 
+  // sibling trees with the same target indices are fused into one task (in the order of their first member)
+  vector<vector<shared_ptr<Tree>>> groups;
+  vector<string> keys;
   for (auto& i : subtree_) {
-    tie(tmp, tcnt, t0, itensors) = i->generate_task_list(tcnt, t0, gamma, itensors);
+    const string key = i->fusion_key();
+    auto iter = key.empty() ? keys.end() : find(keys.begin(), keys.end(), key);
+    if (iter != keys.end()) {
+      groups[iter - keys.begin()].push_back(i);
+    } else {
+      groups.push_back({i});
+      keys.push_back(key);
+    }
+  }
+
+  for (auto& g : groups) {
+    if (g.size() == 1)
+      tie(tmp, tcnt, t0, itensors) = g.front()->generate_task_list(tcnt, t0, gamma, itensors);
+    else
+      tie(tmp, tcnt, t0, itensors) = g.front()->generate_fused(g, tcnt, t0, gamma, itensors);
     out << tmp;
   }
   return make_tuple(out, tcnt, t0, itensors);
@@ -626,6 +1031,8 @@ tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
     if (find(itensors.begin(), itensors.end(), s) == itensors.end() && s->label().find("I") != string::npos) {
       itensors.push_back(s);
       out.ee << s->constructor_str(diagonal) << endl;
+      if (reuse_queues)
+        out.ee << keep__(label(), s);
     }
   }
   out << generate_task(num_, source_tensors, gamma, t0, diagonal);
@@ -738,7 +1145,7 @@ tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
       out << tmp;
 
     } else {  // trees without root target indices
-      out.ee << "  auto " << label() << "q = make_shared<Queue>();" << endl;
+      out.ee << "  auto " << label() << "q = " << (state_batch ? "queue ? queue : " : "") << "make_shared<Queue>();" << endl;
       num_ = tcnt;
       for (auto& j : bc_) {
         tie(tmp, tcnt, t0, itensors) = j->generate_task_list(tcnt, t0, gamma, itensors);
@@ -785,6 +1192,8 @@ tuple<OutStream, int, vector<shared_ptr<Tensor>>>
     if (find(itensors.begin(), itensors.end(), s) == itensors.end() && s->label().find("I") != string::npos) {
       itensors.push_back(s);
       out.ee << s->constructor_str(diagonal) << endl;
+      if (reuse_queues)
+        out.ee << keep__(label(), s);
     }
   }
   // saving a counter to a protected member for dependency checks
@@ -847,6 +1256,8 @@ tuple<OutStream, int, vector<shared_ptr<Tensor>>>
     if (find(itensors.begin(), itensors.end(), s) == itensors.end() && s->label().find("I") != string::npos) {
       itensors.push_back(s);
       out.ee << s->constructor_str(diagonal) << endl;
+      if (reuse_queues)
+        out.ee << keep__(label(), s);
     }
   }
   // saving a counter to a protected member for dependency checks
@@ -898,6 +1309,80 @@ tuple<OutStream, int, vector<shared_ptr<Tensor>>>
 }
 
 
+string Tree::fusion_key() const {
+  if (!fuse_siblings() || depth() == 0 || !op_.empty() || bc_.size() != 1)
+    return "";
+  shared_ptr<BinaryContraction> i = bc_.front();
+  vector<shared_ptr<Tensor>> source_tensors = i->tensors_vec();
+  bool cicontraction = (((source_tensors[1]->label().find("Gamma") != string::npos) || (source_tensors[1]->label().find("rdm0") != string::npos))
+      && (this->label().find("deci") != string::npos));
+  if (cicontraction || i->target_indices().empty())
+    return "";
+  string out = i->diagonal_only() ? "d" : "n";
+  for (auto& j : i->target_indices())
+    out += " " + j->str_gen();
+  return out;
+}
+
+
+tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
+    Tree::generate_fused(const vector<shared_ptr<Tree>>& trees, int tcnt, int t0, const list<shared_ptr<Tensor>> gamma, vector<shared_ptr<Tensor>> itensors) const {
+  OutStream out;
+  OutStream tmp;
+  vector<shared_ptr<BinaryContraction>> bcs;
+  for (auto& i : trees)
+    bcs.push_back(i->bc_.front());
+
+  // the target followed by the operands of every contraction; inputs of the task are distinct tensors in the order of appearance
+  vector<shared_ptr<Tensor>> source_tensors = { bcs.front()->tensors_vec().front() };
+  vector<string> done;
+  auto input = [&done](const string& label) {
+    auto iter = find_if(done.begin(), done.end(), [&label](const string& i) { return same_tensor__(label, i); });
+    if (iter == done.end())
+      iter = done.insert(done.end(), label);
+    return "in(" + to_string(iter - done.begin()) + ")";
+  };
+  for (auto& i : bcs) {
+    source_tensors.push_back(i->tensor());
+    source_tensors.push_back(i->next_target());
+    const string in0 = input(i->tensor()->label());
+    i->set_input_labels(in0, input(i->next_target()->label()));
+  }
+
+  const bool diagonal = bcs.front()->diagonal_only();
+  for (auto& s : source_tensors) {
+    // if it contains a new intermediate tensor, dump a constructor
+    if (find(itensors.begin(), itensors.end(), s) == itensors.end() && s->label().find("I") != string::npos) {
+      itensors.push_back(s);
+      out.ee << s->constructor_str(diagonal) << endl;
+      if (reuse_queues)
+        out.ee << keep__(label(), s);
+    }
+  }
+  // saving a counter to a protected member for dependency checks; subtrees of every sibling depend on this task
+  num_ = tcnt;
+  for (auto& i : trees)
+    i->num_ = tcnt;
+  out << generate_task(num_, source_tensors, gamma, t0, diagonal);
+
+  list<shared_ptr<const Index>> ti = bcs.front()->target_indices();
+  out << generate_compute_header(num_, ti, source_tensors);
+  out << generate_bcs(bcs);
+  out << generate_compute_footer(num_, ti, source_tensors, false);
+  for (auto& i : bcs)
+    i->reset_input_labels();
+
+  // increment tcnt before going to subtrees, which all are dependencies of this task
+  ++tcnt;
+  for (auto& i : bcs) {
+    tie(tmp, tcnt, t0, itensors) = i->generate_task_list(tcnt, t0, gamma, itensors);
+    out << tmp;
+  }
+
+  return make_tuple(out, tcnt, t0, itensors);
+}
+
+
 tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
     Tree::generate_steps(string indent, int tcnt, int t0, const list<shared_ptr<Tensor>> gamma, vector<shared_ptr<Tensor>> itensors) const {
   OutStream out, tmp;
@@ -910,6 +1395,8 @@ tuple<OutStream, int, int, vector<shared_ptr<Tensor>>>
     if (find(itensors.begin(), itensors.end(), target_) == itensors.end()) {
       itensors.push_back(target_);
       out.ee << target_->constructor_str(diagonal_only()) << endl;
+      if (reuse_queues)
+        out.ee << keep__(label(), target_);
     }
 
     vector<shared_ptr<Tensor>> op = {target_};
@@ -78,6 +78,12 @@ class BinaryContraction {
     std::shared_ptr<Tensor> next_target();
     /// Returns vector of tensor with target tensor.
     std::vector<std::shared_ptr<Tensor>> tensors_vec();
+    /// Returns the labels of tensor_ and next_target() in generated tasks, in(0) and in(1) (or in(0) for the same tensor) unless set.
+    std::pair<std::string, std::string> input_labels();
+    /// Sets the labels of tensor_ and next_target() for tasks that fuse several contractions.
+    void set_input_labels(const std::string& a, const std::string& b);
+    /// Restores the default labels once the fused task is generated.
+    void reset_input_labels();
 
     /// Print binary contraction.
     void print() const;
@@ -101,6 +107,16 @@ class BinaryContraction {
 
     /// Returns a list of inner loop indices, i.e., those which are the same between tensor_ and target_.
     std::list<std::shared_ptr<const Index>> loop_indices();
+    /// Returns the target and the summed index of tensor_ if it is a closed-closed or virtual-virtual block of f1, which is diagonal for canonical orbitals. Empty otherwise.
+    std::pair<std::shared_ptr<const Index>, std::shared_ptr<const Index>> diagonal_fock_block();
+    /// Generates the call of the compile-time sized kernel for all-active contractions, which returns false (dgemm follows) for other block sizes. Empty if not all active.
+    std::string generate_active_kernel(const std::string& m, const std::string& n, const std::string& k, const std::string& beta);
+    /// Generates the buffers into which the sorted operand blocks of all inner-loop tuples are stacked along the summed dimension.
+    std::string generate_stack(const std::string& dindent, const std::string& m, const std::string& n, const std::string& k);
+    /// Generates the condition under which the product of operand block norms is below the screening threshold.
+    std::string generate_screening();
+    /// Generates flattened inner loops in which the operand blocks of the next iteration are fetched asynchronously. Loops are closed by close.
+    std::string generate_prefetch(std::string& dindent, std::vector<std::string>& close);
     /// Returns a list of target indices..these are to be stored (via put_block).
     std::list<std::shared_ptr<const Index>> target_indices();
     /// Return excitation target indices.
@@ -168,6 +184,13 @@ class Tree {
     /// If top of tree has target indices.
     const bool root_targets_;
 
+    /// Number of tasks that read each intermediate, see count_consumers().
+    static std::map<std::string, int> consumers_;
+    /// Generates code in compute_() that releases input intermediates of which this task is the only consumer.
+    std::string generate_release(const std::vector<std::shared_ptr<Tensor>>& tensors) const;
+    /// Generates the cost descriptor of a task that adds up (op_) or contracts (bc_) tensors into tensors.front().
+    OutStream generate_cost(const int ic, const std::vector<std::shared_ptr<Tensor>>& tensors) const;
+
 
   public:
     /// Construct tree from equation and set tree label. Tree construction starts here.
@@ -232,6 +255,12 @@ class Tree {
     void find_gamma(std::shared_ptr<Tensor> o);
     /// Recursive function to collect all Gamma tensors in graph.
     std::list<std::shared_ptr<Tensor>> gather_gamma() const;
+    /// Recursive function to count the tasks that read each intermediate tensor in graph.
+    void count_consumers(std::map<std::string, int>& count) const;
+    /// Sets the number of consuming tasks of intermediates (forest wide), used to release them after their only consumer.
+    static void set_consumers(const std::map<std::string, int>& count) { consumers_ = count; }
+    /// Recursive function that follows the queue (children before parents) and records the memory of live intermediates after each allocation in peaks.
+    void simulate_memory(std::map<std::string, MCost>& live, std::vector<MCost>& peaks) const;
     /// Returns gamma_, list of unique Gamma tensors.
     std::list<std::shared_ptr<Tensor>> gamma() const { return gamma_; }
 
@@ -273,8 +302,16 @@ class Tree {
     std::tuple<OutStream, int, std::vector<std::shared_ptr<Tensor>>>
         binarycontraction_generate(std::shared_ptr<BinaryContraction> i, int tcnt, const std::list<std::shared_ptr<Tensor>> gamma, int t0, std::vector<std::shared_ptr<Tensor>> itensors) const;
 
+    /// Returns the key under which this tree is fused with its siblings (empty if it cannot be fused).
+    std::string fusion_key() const;
+    /// Generates one task for sibling trees that share a fusion key, followed by their subtrees.
+    std::tuple<OutStream, int, int, std::vector<std::shared_ptr<Tensor>>>
+        generate_fused(const std::vector<std::shared_ptr<Tree>>& trees, int tcnt, int t0, const std::list<std::shared_ptr<Tensor>> gamma, std::vector<std::shared_ptr<Tensor>> itensors) const;
+
     /// Generate task for operator task (ie not a binary contraction task). Dagger arguement refers to front subtree used at top level.
     OutStream generate_compute_operators(const std::shared_ptr<Tensor>, const std::vector<std::shared_ptr<Tensor>>, const bool dagger = false) const;
+    /// Generates one loop that accumulates all the source blocks of an operator task into the target block.
+    std::string generate_fused_sources(const std::string cindent, std::shared_ptr<Tensor> target, const std::vector<std::shared_ptr<Tensor>> op, const std::map<std::string, int>& op_tensor_lab, const bool dagger) const;
 
     // Tree specific code generation moved to derived classes.
     /// Needed for zero level target tensors. Generates a Task '0' ie task to initialize top (zero depth) target tensor also sets up dependency queue.
@@ -292,6 +329,10 @@ class Tree {
     virtual OutStream generate_compute_footer(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool dot) const = 0;
     /// Generate Binary contraction code.
     virtual OutStream generate_bc(const std::shared_ptr<BinaryContraction>) const = 0;
+    /// Whether sibling contractions into the same target block are fused into one task (see generate_bcs).
+    virtual bool fuse_siblings() const { return false; }
+    /// Generates the code of a task that fuses sibling contractions with the same target indices.
+    virtual OutStream generate_bcs(const std::vector<std::shared_ptr<BinaryContraction>>&) const { throw std::logic_error("Tree::generate_bcs"); }
     /// With sources
     virtual OutStream generate_bc_sources(const int, const std::list<std::shared_ptr<const Index>> ti, const std::vector<std::shared_ptr<Tensor>>, const bool, const bool, const std::shared_ptr<BinaryContraction>) const = 0;
 